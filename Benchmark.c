@@ -0,0 +1,271 @@
+//Benchmarks the core file system calls on freshly made disks.
+//gcc -O2 Benchmark.c -o myfs-bench -lm -pthread
+//./myfs-bench [-quick] [-json] [-size bytes] [-image path]
+#define MYFS_NO_MAIN
+#include "FileSystem.c"
+
+#define BENCH_LS_ROUNDS 10
+
+struct BenchCase {
+	char* backend; //"memory" or "image"
+	int blockSize;
+	int diskSize; //MB
+	int files;
+	int fileSize;
+	int fill; //percent of data blocks taken before the run
+};
+
+struct BenchResult {
+	char* op;
+	int ops;
+	int errors;
+	double seconds;
+	double* latency; //one entry per op, in seconds
+};
+
+int compareDouble(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+void printResult(struct BenchCase* c, struct BenchResult* r, int json) {
+	qsort(r -> latency, r -> ops, sizeof(double), compareDouble);
+	double mean = r -> ops > 0 ? r -> seconds / r -> ops : 0;
+	double p50 = r -> ops > 0 ? r -> latency[r -> ops / 2] : 0;
+	double p99 = r -> ops > 0 ? r -> latency[(int)(r -> ops * 0.99)] : 0;
+	double max = r -> ops > 0 ? r -> latency[r -> ops - 1] : 0;
+	double rate = r -> seconds > 0 ? r -> ops / r -> seconds : 0;
+	if(json)
+		printf("{\"backend\":\"%s\",\"block_size\":%d,\"disk_mb\":%d,\"files\":%d,\"file_size\":%d,\"fill_pct\":%d,"
+			"\"op\":\"%s\",\"ops\":%d,\"errors\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+			"\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+			c -> backend, c -> blockSize, c -> diskSize, c -> files, c -> fileSize, c -> fill,
+			r -> op, r -> ops, r -> errors, r -> seconds, rate, mean * 1e6, p50 * 1e6, p99 * 1e6, max * 1e6);
+	else
+		printf("%s,%d,%d,%d,%d,%d,%s,%d,%d,%.6f,%.1f,%.3f,%.3f,%.3f,%.3f\n",
+			c -> backend, c -> blockSize, c -> diskSize, c -> files, c -> fileSize, c -> fill,
+			r -> op, r -> ops, r -> errors, r -> seconds, rate, mean * 1e6, p50 * 1e6, p99 * 1e6, max * 1e6);
+	fflush(stdout);
+}
+
+//Takes fill percent of the data blocks with one file in a directory of its
+//own, so the bitmaps are that full but ls of the root is unaffected.
+void fillDisk(struct Disk* disk, int fill) {
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	long long bytes = (long long)sb.dataCount * sb.blockSize * fill / 100;
+	if(bytes == 0)
+		return;
+	makeDirectory(disk, -1, (unsigned char*)"pad");
+	int isDirectory, pad = dentryLookup(disk, -1, (unsigned char*)"pad", &isDirectory);
+	createFile(disk, pad, (unsigned char*)"fill");
+	int ino = dentryLookup(disk, pad, (unsigned char*)"fill", &isDirectory);
+	unsigned char* chunk = (unsigned char*)calloc(IO_CHUNK, 1);
+	while(bytes > 0 && appendFile(disk, ino, chunk, bytes < IO_CHUNK ? bytes : IO_CHUNK) > 0)
+		bytes -= IO_CHUNK;
+	free(chunk);
+}
+
+//Returns -1 when the case does not fit on its disk or the disk cannot be made.
+int runCase(struct BenchCase* c, struct Disk* root, char* imagePath, int json) {
+	struct Disk* disk = (struct Disk*)malloc(sizeof(struct Disk));
+	if(imagePath == NULL && createDisk(disk, c -> diskSize, c -> blockSize) < 0) {
+		fprintf(stderr, "Cannot map a %d MB memory disk\n", c -> diskSize);
+		free(disk);
+		return -1;
+	}
+	else if(imagePath != NULL && createDiskImage(disk, imagePath, c -> diskSize, c -> blockSize) < 0) {
+		fprintf(stderr, "Cannot create image %s\n", imagePath);
+		free(disk);
+		return -1;
+	}
+	createFileSystem(disk);
+	char mountName[STRING_SIZE] = "B:";
+	mountFileSystem(root, disk, mountName);
+	fillDisk(disk, c -> fill);
+
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	long long blocksPerFile = (c -> fileSize + c -> blockSize - 1) / c -> blockSize;
+	blocksPerFile += pointerBlocksFor(blocksPerFile, c -> blockSize);
+	int freeBlocks = freeDataCount(disk);
+	if(c -> files + 2 > sb.inodeCount || blocksPerFile * c -> files > freeBlocks) {
+		unmountFileSystem(root, disk);
+		closeDisk(disk);
+		free(disk);
+		if(imagePath != NULL)
+			unlink(imagePath);
+		return -1;
+	}
+
+	int* inumbers = (int*)malloc(c -> files * sizeof(int));
+	char (*paths)[32] = malloc(c -> files * sizeof(*paths));
+	unsigned char* data = (unsigned char*)malloc(c -> fileSize + 1);
+	unsigned char name[16];
+	struct Path p1;
+	struct BenchResult r;
+	int i, j, isDirectory;
+	double t;
+	for(i = 0; i < c -> fileSize; i += 1)
+		data[i] = 'a' + rand() % 26;
+	r.latency = (double*)malloc((c -> files > BENCH_LS_ROUNDS ? c -> files : BENCH_LS_ROUNDS) * sizeof(double));
+
+	r.op = "create";
+	r.ops = c -> files;
+	r.errors = 0;
+	r.seconds = 0;
+	for(i = 0; i < c -> files; i += 1) {
+		snprintf((char*)name, sizeof(name), "f%d", i);
+		t = now();
+		if(createFile(disk, -1, name) < 0)
+			r.errors += 1;
+		r.latency[i] = now() - t;
+		r.seconds += r.latency[i];
+		inumbers[i] = dentryLookup(disk, -1, name, &isDirectory);
+		snprintf(paths[i], sizeof(paths[i]), "B:\\%s", name);
+	}
+	printResult(c, &r, json);
+
+	r.op = "write";
+	r.errors = 0;
+	r.seconds = 0;
+	for(i = 0; i < c -> files; i += 1) {
+		t = now();
+		if(writeFile(disk, inumbers[i], data, c -> fileSize) < 0)
+			r.errors += 1;
+		r.latency[i] = now() - t;
+		r.seconds += r.latency[i];
+	}
+	printResult(c, &r, json);
+
+	r.op = "read";
+	r.errors = 0;
+	r.seconds = 0;
+	for(i = 0; i < c -> files; i += 1) {
+		t = now();
+		if(readFile(disk, inumbers[i], data) != c -> fileSize)
+			r.errors += 1;
+		r.latency[i] = now() - t;
+		r.seconds += r.latency[i];
+	}
+	printResult(c, &r, json);
+
+	r.op = "path";
+	r.errors = 0;
+	r.seconds = 0;
+	for(i = 0; i < c -> files; i += 1) {
+		t = now();
+		if(resolvePath(paths[i], &p1, root, NULL) < 0 || p1.inumber != inumbers[i])
+			r.errors += 1;
+		r.latency[i] = now() - t;
+		r.seconds += r.latency[i];
+	}
+	printResult(c, &r, json);
+
+	//ls prints, so stdout points at /dev/null while it runs.
+	r.op = "ls";
+	r.ops = BENCH_LS_ROUNDS;
+	r.errors = 0;
+	r.seconds = 0;
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO), devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, STDOUT_FILENO);
+	for(j = 0; j < BENCH_LS_ROUNDS; j += 1) {
+		t = now();
+		ls(disk, -1);
+		fflush(stdout);
+		r.latency[j] = now() - t;
+		r.seconds += r.latency[j];
+	}
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(devNull);
+	printResult(c, &r, json);
+
+	r.op = "remove";
+	r.ops = c -> files;
+	r.errors = 0;
+	r.seconds = 0;
+	for(i = 0; i < c -> files; i += 1) {
+		t = now();
+		if(removeFile(disk, inumbers[i]) < 0)
+			r.errors += 1;
+		r.latency[i] = now() - t;
+		r.seconds += r.latency[i];
+	}
+	printResult(c, &r, json);
+
+	free(r.latency);
+	free(data);
+	free(paths);
+	free(inumbers);
+	unmountFileSystem(root, disk);
+	closeDisk(disk);
+	free(disk);
+	if(imagePath != NULL)
+		unlink(imagePath);
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	int blockSizes[] = {512, 4096, 65536};
+	int diskSizes[] = {16, 256};
+	int fileCounts[] = {100, 1000, 10000};
+	int fills[] = {0, 50, 95};
+	int nBlock = 3, nDisk = 2, nFiles = 3, nFill = 3;
+	int json = 0, fileSize = 4096, i;
+	char* imagePath = NULL;
+	for(i = 1; i < argc; i += 1) {
+		if(strcmp(argv[i], "-quick") == 0) {
+			nBlock = 2;
+			nDisk = 1;
+			nFiles = 2;
+			fills[1] = 95;
+			nFill = 2;
+		}
+		else if(strcmp(argv[i], "-json") == 0)
+			json = 1;
+		else if(strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+			fileSize = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-image") == 0 && i + 1 < argc)
+			imagePath = argv[++i];
+		else {
+			fprintf(stderr, "usage: %s [-quick] [-json] [-size bytes] [-image path]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(fileSize < 1) {
+		fprintf(stderr, "File size must be positive\n");
+		return 1;
+	}
+
+	struct Disk* root = (struct Disk*)malloc(sizeof(struct Disk));
+	if(createDisk(root, 1, 512) < 0) {
+		fprintf(stderr, "Cannot map the root disk\n");
+		return 1;
+	}
+	createFileSystem(root);
+	srand(1);
+	if(json == 0)
+		printf("backend,block_size,disk_mb,files,file_size,fill_pct,op,ops,errors,seconds,ops_per_sec,mean_us,p50_us,p99_us,max_us\n");
+
+	struct BenchCase c;
+	int b, d, f, l;
+	c.backend = imagePath == NULL ? "memory" : "image";
+	c.fileSize = fileSize;
+	for(b = 0; b < nBlock; b += 1)
+		for(d = 0; d < nDisk; d += 1)
+			for(f = 0; f < nFiles; f += 1)
+				for(l = 0; l < nFill; l += 1) {
+					c.blockSize = blockSizes[b];
+					c.diskSize = diskSizes[d];
+					c.files = fileCounts[f];
+					c.fill = fills[l];
+					if(runCase(&c, root, imagePath, json) < 0)
+						fprintf(stderr, "skipped %s bs=%d disk=%dMB files=%d fill=%d%%: does not fit\n",
+							c.backend, c.blockSize, c.diskSize, c.files, c.fill);
+				}
+	closeDisk(root);
+	free(root);
+	return 0;
+}
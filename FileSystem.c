@@ -1,702 +1,5400 @@
+#define _GNU_SOURCE //fallocate
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#ifndef MYFS_NO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define STRING_SIZE 10
+#define PATH_SIZE 256
 
 //--------------MISCELLANEOUS------------------//
-#define LSH_RL_BUFSIZE 1024
+#define READ_CHUNK (1 << 16)
+#define MAX_ARGS 64
+#define CACHE_LINE 64
 int min(int a, int b) {
 	if(a < b)
 		return a;
 	return b;
 }
 
-char *lsh_read_line(void) {
-  int bufsize = LSH_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
-
-  if (!buffer) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
-
-  while (1) {
-    // Read a character
-    c = getchar();
-
-    if (c == EOF) {
-      exit(EXIT_SUCCESS);
-    } 
-    else if (c == '\n') {
-      buffer[position] = '\0';
-      return buffer;
-    } 
-    else {
-      buffer[position] = c;
-    }
-    position++;
-
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += LSH_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
-      if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-    }
-  }
-}
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
-char **lsh_split_line(char *line) {
-  int bufsize = LSH_TOK_BUFSIZE, position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token, **tokens_backup;
-
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
-
-  token = strtok(line, LSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
-
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
-      tokens_backup = tokens;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
-      if (!tokens) {
-		free(tokens_backup);
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-    }
-
-    token = strtok(NULL, LSH_TOK_DELIM);
-  }
-  tokens[position] = NULL;
-  return tokens;
+//Hands out input lines straight from a large read buffer, so reading a
+//script costs one read call per chunk instead of one call per character.
+struct LineReader {
+	int fd;
+	char* buffer;
+	int size;
+	int start; //first byte not yet handed out
+	int end; //bytes read into buffer
+	int eof;
+	long long lines;
+};
+
+void initLineReader(struct LineReader* reader, int fd) {
+	reader -> fd = fd;
+	reader -> size = READ_CHUNK + 1;
+	reader -> buffer = (char*)malloc(reader -> size);
+	reader -> start = reader -> end = reader -> eof = 0;
+	reader -> lines = 0;
 }
-//---------------------------------------------//
 
-//---------------DISK TEMPLATE----------------//
-struct Disk {
-	unsigned char* buffer;
-	int totalSize; //in MB
-	int blockSize; //in B
+void freeLineReader(struct LineReader* reader) {
+	free(reader -> buffer);
+}
+
+//Returns the next line without its newline, or NULL at end of input. The
+//line lives in the reader's buffer and is only valid until the next call.
+char* readLine(struct LineReader* reader) {
+	int searched = reader -> start, n;
+	while(1) {
+		char* newline = memchr(reader -> buffer + searched, '\n', reader -> end - searched);
+		if(newline != NULL || (reader -> eof && reader -> start < reader -> end)) {
+			char* line = reader -> buffer + reader -> start;
+			if(newline == NULL)
+				newline = reader -> buffer + reader -> end; //last line has no newline
+			*newline = 0;
+			reader -> start = newline - reader -> buffer + 1;
+			if(reader -> start > reader -> end)
+				reader -> start = reader -> end;
+			reader -> lines += 1;
+			return line;
+		}
+		if(reader -> eof)
+			return NULL;
+		searched = reader -> end - reader -> start;
+		memmove(reader -> buffer, reader -> buffer + reader -> start, searched);
+		reader -> end = searched;
+		reader -> start = 0;
+		if(reader -> size - reader -> end <= READ_CHUNK) {
+			reader -> size = 2 * reader -> size + READ_CHUNK;
+			reader -> buffer = (char*)realloc(reader -> buffer, reader -> size);
+		}
+		n = read(reader -> fd, reader -> buffer + reader -> end, reader -> size - reader -> end - 1);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			reader -> eof = 1;
+		else
+			reader -> end += n;
+	}
+}
+
+int isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\a';
+}
+
+//Splits line in place on blanks. tokens must hold max + 1 pointers; unused
+//ones are set to NULL. Returns the number of tokens, or -1 if there are more
+//than max, in which case the first max are kept.
+int splitLine(char* line, char** tokens, int max) {
+	int count = 0, result = 0;
+	while(*line != 0) {
+		while(isBlank(*line))
+			line += 1;
+		if(*line == 0)
+			break;
+		if(count == max) {
+			result = -1; //Too many tokens
+			break;
+		}
+		tokens[count] = line;
+		count += 1;
+		while(*line != 0 && isBlank(*line) == 0)
+			line += 1;
+		if(*line != 0) {
+			*line = 0;
+			line += 1;
+		}
+	}
+	memset(tokens + count, 0, (max + 1 - count) * sizeof(char*));
+	return result < 0 ? result : count;
+}
+
+//Scratch memory for the buffers a call needs only while it runs. Every
+//thread has its own arena: ARENA_RESERVE bytes of address space that only
+//take memory once touched. A call takes a mark on entry and resets to it on
+//the way out, which frees everything it allocated at once, and nested calls
+//simply stack. Back at empty, pages past the first ARENA_KEEP are dropped,
+//so one large command does not keep its memory.
+#define ARENA_RESERVE ((size_t)1 << 30)
+#define ARENA_KEEP ((size_t)1 << 20)
+#define ARENA_ALIGN 16
+
+struct Arena {
+	unsigned char* base; //NULL until first used
+	size_t used;
+	size_t peak; //highest used since the last trim
 };
 
-void createDisk(struct Disk* disk, int totalSize, int blockSize);
-void readBlock(struct Disk* disk, int blockNumber, unsigned char* data);
-void writeBlock(struct Disk* disk, int blockNumber, unsigned char* data);
-//--------------------------------------------//
+__thread struct Arena arena;
 
-//---------------DISK CODE--------------------//
-void createDisk(struct Disk* disk, int totalSize, int blockSize) {
-	disk -> totalSize = totalSize;
-	disk -> blockSize = blockSize;
-	disk -> buffer = (unsigned char*)malloc(totalSize * (int)(pow(2, 20)) * sizeof(unsigned char));
+size_t arenaMark() {
+	return arena.used;
 }
 
-void readBlock(struct Disk* disk, int blockNumber, unsigned char* data) {
-	data = realloc(data, disk -> blockSize);
-	memcpy(data, (disk -> buffer) + blockNumber * (disk -> blockSize), disk -> blockSize);
+//Returns NULL only when the arena is out of address space. For sizes
+//that come from the user; everything else uses arenaAlloc.
+void* arenaTryAlloc(size_t size) {
+	if(arena.base == NULL) {
+		void* base = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(base == MAP_FAILED)
+			return NULL;
+		arena.base = (unsigned char*)base;
+	}
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if(size > ARENA_RESERVE - arena.used)
+		return NULL;
+	void* memory = arena.base + arena.used;
+	arena.used += size;
+	if(arena.used > arena.peak)
+		arena.peak = arena.used;
+	return memory;
 }
 
-void writeBlock(struct Disk* disk, int blockNumber, unsigned char* data) {
-	data = realloc(data, disk -> blockSize);
-	memcpy((disk -> buffer) + blockNumber * (disk -> blockSize), data, disk -> blockSize);
+//Internal requests are bounded far below ARENA_RESERVE, so running out
+//means a caller never reset its mark. That is fatal, not a NULL to check.
+void* arenaAlloc(size_t size) {
+	void* memory = arenaTryAlloc(size);
+	if(memory == NULL) {
+		fprintf(stderr, "Scratch arena exhausted\n");
+		abort();
+	}
+	return memory;
+}
+
+void arenaReset(size_t mark) {
+	arena.used = mark;
+	if(mark == 0 && arena.peak > ARENA_KEEP) {
+		madvise(arena.base + ARENA_KEEP, arena.peak - ARENA_KEEP, MADV_DONTNEED);
+		arena.peak = ARENA_KEEP;
+	}
 }
+
+//For threads that are about to exit.
+void arenaRelease() {
+	if(arena.base != NULL)
+		munmap(arena.base, ARENA_RESERVE);
+	arena.base = NULL;
+	arena.used = arena.peak = 0;
+}
+//---------------------------------------------//
+
+//---------------STATS TEMPLATE---------------//
+//Counters are bumped with relaxed atomics and never take a lock, so they
+//stay on all the time.
+#define OP_CREATE 0
+#define OP_READ 1
+#define OP_WRITE 2
+#define OP_REMOVE 3
+#define OP_LS 4
+#define OP_COUNT 5
+#define HIST_SUB_BUCKETS 8 //linear steps per power of two
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 42) //up to about 2^44 ns
+
+struct DiskStats {
+	uint64_t blockReads, blockWrites; //borrowBlock calls by mode
+	uint64_t bytesRead, bytesWritten; //file data moved
+	uint64_t allocations; //bitmapAllocExtent calls
+	uint64_t allocWords; //bitmap words scanned to find free bits
+	uint64_t pathSteps; //path components resolved on this disk
+	uint64_t journalCommits; //group commits, each one flush
+	uint64_t journalBlocks; //metadata blocks logged by those commits
+	uint64_t sharedBlocks; //block writes saved by deduplication
+	uint64_t prefetchBlocks; //data blocks handed to read ahead
+};
+
+//Log-linear buckets like HdrHistogram: every power of two of nanoseconds
+//is split into HIST_SUB_BUCKETS equal steps.
+struct LatencyHistogram {
+	uint64_t count, totalNanos, maxNanos;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct LatencyHistogram opLatency[OP_COUNT];
+char* opNames[OP_COUNT] = {"create", "read", "write", "rm", "ls"};
+
+void statAdd(uint64_t* counter, uint64_t n);
+uint64_t statGet(uint64_t* counter);
+uint64_t nowNanos();
+void recordLatency(int op, uint64_t started);
+int latencyBucket(uint64_t nanos);
+uint64_t bucketLow(int bucket);
+uint64_t latencyPercentile(struct LatencyHistogram* h, double q);
 //--------------------------------------------//
 
-//-------------FILE SYSTEM TEMPLATE-----------//
-#define POINTERS_PER_INODE 5 // Must be >= 5
-#define VALID_MAGIC_NUMBER 1234
+//---------------DISK TEMPLATE----------------//
+#define MAP_CACHE_SIZE 64
 
-struct SuperBlock {
-	int magicNumber;
-	int totalBlockCount;
-	int inodeCount, mountCount, directoryCount, dataCount;
-	int inodeBitmap, mountBitmap, directoryBitmap, dataBitmap;
-	int inode, mount, directory, data;
+struct MapEntry {
+	int inumber; //-1 when empty
+	long long group; //which run of pointers in the file's indirect tree
+	int leaf; //indirect block holding that run
 };
 
-struct Inode {
+#define DENTRY_CACHE_SIZE 4096
+#define READ_STREAMS 64
+#define READAHEAD_MIN 131072 //bytes prefetched once a file is read in order
+#define READAHEAD_MAX 2097152 //the window doubles up to this
+#define INODE_LOCKS 64
+#define ENTRY_LOCKS 64
+
+struct Dentry {
+	int parent; //directory inumber, -1 for the disk root
+	int inumber; //-1 when empty
 	int isDirectory;
-	int sizeofFile;
-	int blockNumbers[POINTERS_PER_INODE];
+	unsigned char name[STRING_SIZE];
 };
 
-struct Mount {
+//Where the last read of a file ended, to tell sequential readers apart.
+struct ReadStream {
+	int inumber; //-1 when empty
+	long long next; //offset the next read starts at if it is sequential
+	long long ahead; //file blocks below this have been prefetched
+	int window; //blocks prefetched past a read, 0 until the stream is sequential
+};
+
+struct MountName {
 	unsigned char diskName[STRING_SIZE];
 	struct Disk* location;
-	int magicNumber;
 };
 
-struct Directory {
-	unsigned char fileName[STRING_SIZE];
-	int inumber;
+struct Disk {
+	unsigned char* buffer;
+	int totalSize; //in MB
+	int blockSize; //in B
+	int fd; //backing image, -1 for in-memory disks
+	int pinned; //blocks currently borrowed
+	int dirtyLow, dirtyHigh; //range of blocks written since the last sync
+	int freedLow, freedHigh; //data blocks freed since the last journal commit
+	struct BufferCache* cache; //metadata cache of image disks, NULL otherwise
+	struct MapEntry mapCache[MAP_CACHE_SIZE]; //recent indirect block lookups
+	struct Dentry* dentries; //recent name lookups
+	struct ReadStream streams[READ_STREAMS]; //by inumber, slot guarded by its entry lock
+	struct MountName* mountNames; //in-memory copy of the mount table
+	int mountNameCount; //-1 when mountNames must be reloaded
+	pthread_rwlock_t namespaceLock; //directory table, index and mount table
+	pthread_rwlock_t inodeLocks[INODE_LOCKS]; //file contents, striped by inumber
+	pthread_mutex_t entryLocks[ENTRY_LOCKS]; //map and dentry cache slots
+	pthread_mutex_t mountLock; //mountNames
+	pthread_mutex_t dedupLock; //refcount table and fingerprint index
+	int blockShift; //log2 of blockSize, -1 while unknown or not a power of two
+	struct DiskStats stats;
+	struct Journal* journal; //metadata journal of image disks, NULL otherwise
 };
 
-struct Path {
-	struct Disk* location;
-	int inumber;
-};
+#define BLOCK_READ 0
+#define BLOCK_WRITE 1
+#define DISCARD_CHUNK 65536 //freed data is handed back in aligned runs of this many bytes
 
-struct PseudoPath {
-	struct Disk* location;
-	char fileName[10];
+//Block sizes with their own code paths. Each X(shift) becomes a switch case
+//in which the block size is the constant 1 << shift, so record lookups
+//divide by constants. Any other size takes the generic path.
+#define BLOCK_SHIFTS(X) X(9) X(10) X(11) X(12) X(16)
+
+void initDisk(struct Disk* disk, unsigned char* buffer, int fd, int totalSize, int blockSize);
+void setBlockSize(struct Disk* disk, int blockSize);
+int createDisk(struct Disk* disk, int totalSize, int blockSize);
+int createDiskImage(struct Disk* disk, char* imagePath, int totalSize, int blockSize);
+int attachDiskImage(struct Disk* disk, char* imagePath);
+int syncDisk(struct Disk* disk);
+void syncData(struct Disk* disk);
+int closeDisk(struct Disk* disk);
+void discardBytes(struct Disk* disk, off_t offset, off_t length);
+void zeroBlocks(struct Disk* disk, int first, int count);
+unsigned char* borrowBlock(struct Disk* disk, int blockNumber, int mode);
+void returnBlock(struct Disk* disk, int blockNumber);
+void markDirty(struct Disk* disk, int low, int high);
+unsigned char* borrowExtent(struct Disk* disk, int first, int count, int mode);
+void returnExtent(struct Disk* disk);
+void prefetchBlocks(struct Disk* disk, int first, int count);
+void readBlock(struct Disk* disk, int blockNumber, unsigned char* data);
+void writeBlock(struct Disk* disk, int blockNumber, unsigned char* data);
+pthread_rwlock_t* inodeLock(struct Disk* disk, int inumber);
+pthread_mutex_t* entryLock(struct Disk* disk, int slot);
+//--------------------------------------------//
+
+//-------------IO ENGINE TEMPLATE-------------//
+//Batches of block reads and writes against an image file. io_uring takes a
+//whole batch in one system call; where it is missing (or the build sets
+//MYFS_NO_URING) a small pool of threads runs pread and pwrite instead.
+#define IO_QUEUE_DEPTH 64
+#define IO_THREADS 4
+#define IO_MAX_VECTORS 256 //blocks merged into one vectored request
+
+struct IoRequest {
+	int write; //pwrite when set, pread otherwise
+	int fd;
+	void* buffer;
+	size_t length;
+	struct iovec* vectors; //when set, buffer is unused and length is their total
+	int vectorCount;
+	off_t offset;
+	ssize_t result; //bytes moved or -errno, once complete
+	void (*done)(struct IoRequest* request); //called by the thread in ioWait
+	void* owner; //free for the submitter, as is context
+	void* context;
+	struct IoRequest* next; //queue link of the thread pool
 };
 
-void fillWithZero(unsigned char* buffer, int tot);
+struct IoEngine {
+	int uring; //1 on io_uring, 0 on the thread pool
+	int inFlight; //submitted and not yet handed to done
+	int ringFd;
+	unsigned entries;
+	void* sqRing;
+	void* cqRing;
+	void* sqes;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+	void* cqes;
+	unsigned queued; //sqes filled in but not yet passed to the kernel
+	pthread_t threads[IO_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work, finished;
+	struct IoRequest *queue, *queueTail, *completed;
+	int stopping;
+};
 
-void createFileSystem(struct Disk* disk);
-void getSuperBlock(struct Disk* disk, struct SuperBlock* sb);
-void getInode(struct Disk* disk, int base, int inumber, struct Inode* i1);
-void setInode(struct Disk* disk, int base, int inumber, struct Inode* i1);
-void getMount(struct Disk* disk, int base, int inumber, struct Mount* i1);
-void setMount(struct Disk* disk, int base, int inumber, struct Mount* i1);
-void getDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1);
-void setDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1);
+struct IoEngine* createIoEngine(int depth);
+void destroyIoEngine(struct IoEngine* io);
+void ioSubmit(struct IoEngine* io, struct IoRequest** requests, int count);
+ssize_t ioRun(struct IoRequest* request);
+void ioWait(struct IoEngine* io);
+//--------------------------------------------//
 
-void pathResolution(unsigned char* buffer, struct Path* path, struct Disk* rootDisk);
-void partition(unsigned char* buffer, struct PseudoPath* path, struct Disk* rootDisk);
+//-------------BUFFER CACHE TEMPLATE----------//
+#define CACHE_FRAMES 256
 
-int createFile(struct Disk* disk, unsigned char name[10]);
-void releaseFile(struct Disk* disk, int inumber);
-void removeFile(struct Disk* disk, int inumber);
-int writeFile(struct Disk* disk, int inumber, unsigned char* buffer, int len);
-void readFile(struct Disk* disk, int inumber, unsigned char* buffer);
+struct CacheFrame {
+	int blockNumber; //-1 when the frame is free
+	int pins;
+	int dirty;
+	int referenced; //CLOCK second chance bit
+	int resident; //never evicted
+	int next; //hash chain
+	unsigned char* data;
+};
 
-int mountFileSystem(struct Disk* diskBase, struct Disk* diskMount, char name[10]);
-void unmountFileSystem(struct Disk* diskBase, struct Disk* diskMount, char name[10]);
+struct BufferCache {
+	int fd, blockSize;
+	int limit; //blocks below limit are cached
+	struct CacheFrame* frames;
+	int frameCount;
+	int* buckets;
+	int bucketCount; //power of two
+	int hand;
+	long long hits, misses, evictions, writebacks, flushes;
+	int dirtyCount;
+	int journaled; //dirty frames may only be written back by a journal commit
+	struct IoEngine* io; //writes back dirty frames
+	pthread_mutex_t lock; //recursive, a miss may flush
+};
 
-void ls(struct Disk* disk);
+struct BufferCache* createCache(int fd, int blockSize, int limit, int frameCount);
+void destroyCache(struct BufferCache* cache);
+unsigned char* cacheBorrow(struct BufferCache* cache, int blockNumber, int mode);
+void cacheReturn(struct BufferCache* cache, int blockNumber);
+void flushCache(struct BufferCache* cache);
+void printCacheStats(struct BufferCache* cache);
 //--------------------------------------------//
-//-------------FILE SYSTEM CODE---------------//
-void fillWithZero(unsigned char* buffer, int tot) {
-	int i;
-	for(i = 0; i < tot; i += 1)
-		buffer[i] = 0;
-}
 
-void createFileSystem(struct Disk* disk) {
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	sb -> magicNumber = VALID_MAGIC_NUMBER;
-	sb -> totalBlockCount = (disk -> totalSize * (int)pow(2, 20)) / disk -> blockSize;
+//-------------JOURNAL TEMPLATE---------------//
+//Metadata blocks of image disks are logged to a region before the data
+//blocks, and only written in place once a commit record is on disk. Many
+//operations share one commit, so durability costs one flush per group
+//instead of one per create or write.
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 4096
+#define JOURNAL_COMMIT_OPS 256 //operations per group commit
+#define JOURNAL_COMMIT_NANOS 1000000000ULL //or this long after the last one
+#define JOURNAL_HEADER_MAGIC 0x4a4e4c48
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4a4e4c44
+#define JOURNAL_COMMIT_MAGIC 0x4a4e4c43
 
-	int blockCountSuperBlock = 1;
-	int blockCountInodeBitmap = 1;
-	int blockCountMountBitmap = 1;
-	int blockCountDirectoryBitmap = 1;
-	int blockCountDataBitmap = 1;
-	int blockCountInode = (int)(0.1 * sb -> totalBlockCount);
-	int blockCountMount = (int)(0.05 * sb -> totalBlockCount);
-	int blockCountDirectory = (int)(0.1 * sb -> totalBlockCount);
+struct SuperBlock;
 
-	sb -> inodeBitmap = blockCountSuperBlock;
-	sb -> mountBitmap = sb -> inodeBitmap + blockCountInodeBitmap;
-	sb -> directoryBitmap = sb -> mountBitmap + blockCountMountBitmap;
-	sb -> dataBitmap = sb -> directoryBitmap + blockCountDirectoryBitmap;
-	sb -> inode = sb -> dataBitmap + blockCountDataBitmap;
-	sb -> mount = sb -> inode + blockCountInode;
-	sb -> directory = sb -> mount + blockCountMount;
-	sb -> data = sb -> directory + blockCountDirectory;	
+//First block of the journal. Replay starts right after it with this sequence.
+struct JournalHeader {
+	int magic;
+	int sequence;
+};
 
-	int blockCountData = sb -> totalBlockCount - sb -> data;
+//Lists where the blocks that follow it belong.
+struct JournalDescriptor {
+	int magic;
+	int sequence;
+	int count;
+	int blocks[]; //as many as fit in the rest of the block
+};
 
-	int inodePerBlock = disk -> blockSize / sizeof(struct Inode);
-	int mountPerBlock = disk -> blockSize / sizeof(struct Mount);
-	int directoryPerBlock = disk -> blockSize / sizeof(struct Directory);
-	int dataPerBlock = 1;
+//Ends a transaction; without it the transaction is ignored on replay.
+struct JournalCommit {
+	int magic;
+	int sequence;
+	int blocks; //logged blocks in the transaction
+	uint64_t checksum; //of its descriptors and logged blocks
+};
 
-	sb -> inodeCount = min(blockCountInode * inodePerBlock, blockCountInodeBitmap * disk -> blockSize);
-	sb -> mountCount = min(blockCountMount * mountPerBlock, blockCountMountBitmap *  disk -> blockSize);
-	sb -> directoryCount = min(blockCountDirectory * directoryPerBlock, blockCountDirectoryBitmap * disk -> blockSize);
-	sb -> dataCount = min(blockCountData * dataPerBlock, blockCountDataBitmap * disk -> blockSize);
+struct Journal {
+	int start, blocks; //region on disk, header included
+	int head; //next free block of the region
+	int sequence; //of the next transaction
+	int pending; //operations since the last commit
+	int committing;
+	uint64_t lastCommit;
+	pthread_rwlock_t lock; //held shared by operations, exclusively by a commit
+};
 
-	sb -> inodeCount = min(sb -> inodeCount, sb -> directoryCount);
-	sb -> directoryCount = sb -> inodeCount;
+int journalTransaction(struct Disk* disk, struct SuperBlock* sb, int pos, int sequence, int apply);
+int journalReplay(struct Disk* disk, struct SuperBlock* sb);
+int journalOpen(struct Disk* disk, struct SuperBlock* sb);
+void journalBegin(struct Disk* disk);
+void journalEnd(struct Disk* disk);
+int journalCommit(struct Disk* disk);
+int journalClose(struct Disk* disk);
+uint64_t journalChecksum(uint64_t hash, unsigned char* data, int len);
+//--------------------------------------------//
 
-	writeBlock(disk, 0, (unsigned char*)sb);
+//-------------COMPRESSION TEMPLATE-----------//
+//Compressed files are cut into chunks of COMPRESS_CHUNK_SIZE bytes, or of
+//COMPRESS_MIN_BLOCKS blocks when blocks are larger, each compressed on its
+//own in the LZ4 block format.
+#define COMPRESS_CHUNK_SIZE 65536
+#define COMPRESS_MIN_BLOCKS 4
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 //the format ends every block with literals
+#define LZ4_MATCH_LIMIT 12 //no match starts this close to the end
+#define LZ4_MAX_OFFSET 65535
 
-	fillWithZero(temp, disk -> blockSize);
-	writeBlock(disk, sb -> inodeBitmap, temp);
-	writeBlock(disk, sb -> mountBitmap, temp);
-	writeBlock(disk, sb -> directoryBitmap, temp);
-	writeBlock(disk, sb -> dataBitmap, temp);
+int lz4Compress(unsigned char* src, int srcLen, unsigned char* dst, int dstCapacity);
+int lz4Decompress(unsigned char* src, int srcLen, unsigned char* dst, int dstCapacity);
+//--------------------------------------------//
+
+//---------------DISK CODE--------------------//
+void initDisk(struct Disk* disk, unsigned char* buffer, int fd, int totalSize, int blockSize) {
+	disk -> buffer = buffer;
+	disk -> totalSize = totalSize;
+	setBlockSize(disk, blockSize);
+	disk -> fd = fd;
+	disk -> pinned = 0;
+	disk -> dirtyLow = disk -> dirtyHigh = -1;
+	disk -> freedLow = disk -> freedHigh = -1;
+	disk -> cache = NULL;
+	disk -> dentries = (struct Dentry*)malloc(DENTRY_CACHE_SIZE * sizeof(struct Dentry));
+	disk -> mountNames = NULL;
+	disk -> mountNameCount = -1;
+	int i;
+	for(i = 0; i < MAP_CACHE_SIZE; i += 1)
+		disk -> mapCache[i].inumber = -1;
+	for(i = 0; i < DENTRY_CACHE_SIZE; i += 1)
+		disk -> dentries[i].inumber = -1;
+	for(i = 0; i < READ_STREAMS; i += 1)
+		disk -> streams[i].inumber = -1;
+	pthread_rwlock_init(&disk -> namespaceLock, NULL);
+	for(i = 0; i < INODE_LOCKS; i += 1)
+		pthread_rwlock_init(&disk -> inodeLocks[i], NULL);
+	for(i = 0; i < ENTRY_LOCKS; i += 1)
+		pthread_mutex_init(&disk -> entryLocks[i], NULL);
+	pthread_mutex_init(&disk -> mountLock, NULL);
+	pthread_mutex_init(&disk -> dedupLock, NULL);
+	memset(&disk -> stats, 0, sizeof(disk -> stats));
+	disk -> journal = NULL;
 }
 
-void getSuperBlock(struct Disk* disk, struct SuperBlock* sb) {
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, 0, temp);
-	memcpy(sb, (struct SuperBlock*)temp, sizeof(struct SuperBlock));
+void setBlockSize(struct Disk* disk, int blockSize) {
+	disk -> blockSize = blockSize;
+	disk -> blockShift = -1;
+	if(blockSize > 0 && (blockSize & (blockSize - 1)) == 0)
+		disk -> blockShift = __builtin_ctz(blockSize);
 }
 
-void getInode(struct Disk* disk, int base, int inumber, struct Inode* i1) {
-	int inodePerBlock = disk -> blockSize / sizeof(struct Inode);
-	int blockNo = base + inumber / inodePerBlock;
-	int offsetNo = inumber % inodePerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(i1, (struct Inode*)(temp + offsetNo * sizeof(struct Inode)), sizeof(struct Inode));
+//Memory disks are anonymous mappings: pages are zero until first written
+//and only then take memory, so an empty disk costs nothing.
+int createDisk(struct Disk* disk, int totalSize, int blockSize) {
+	unsigned char* buffer = (unsigned char*)mmap(NULL, (size_t)totalSize * (size_t)pow(2, 20), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(buffer == MAP_FAILED)
+		return -1; //Address space not available
+	initDisk(disk, buffer, -1, totalSize, blockSize);
+	return 1;
 }
 
-void setInode(struct Disk* disk, int base, int inumber, struct Inode* i1) {
-	int inodePerBlock = disk -> blockSize / sizeof(struct Inode);
-	int blockNo = base + inumber / inodePerBlock;
-	int offsetNo = inumber % inodePerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(temp + offsetNo * sizeof(struct Inode), (unsigned char*)i1, sizeof(struct Inode));
-	writeBlock(disk, blockNo, temp);
+//The image is mapped shared, so blocks live in the page cache and are
+//written back by the kernel; nothing is staged in process memory. Block
+//numbers are ints, so the disk may not hold more than INT_MAX blocks.
+int createDiskImage(struct Disk* disk, char* imagePath, int totalSize, int blockSize) {
+	off_t length = (off_t)totalSize * (off_t)pow(2, 20);
+	if(totalSize <= 0 || blockSize <= 0 || length / blockSize > INT_MAX)
+		return -2; //Size out of range
+	int fd = open(imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1; //Cannot create image
+	if(ftruncate(fd, length) < 0) {
+		close(fd);
+		return -1;
+	}
+	unsigned char* buffer = (unsigned char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(buffer == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	initDisk(disk, buffer, fd, totalSize, blockSize);
+	return 1;
 }
 
-void getMount(struct Disk* disk, int base, int inumber, struct Mount* i1) {
-	int mountPerBlock = disk -> blockSize / sizeof(struct Mount);
-	int blockNo = base + inumber / mountPerBlock;
-	int offsetNo = inumber % mountPerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(i1, (struct Mount*)(temp + offsetNo * sizeof(struct Mount)), sizeof(struct Mount));
+//Block size is unknown until the file system on the image is loaded.
+int attachDiskImage(struct Disk* disk, char* imagePath) {
+	struct stat st;
+	int fd = open(imagePath, O_RDWR);
+	if(fd < 0)
+		return -1; //Cannot open image
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)pow(2, 20)) {
+		close(fd);
+		return -1;
+	}
+	unsigned char* buffer = (unsigned char*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(buffer == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	initDisk(disk, buffer, fd, st.st_size / (off_t)pow(2, 20), 0);
+	return 1;
 }
 
-void setMount(struct Disk* disk, int base, int inumber, struct Mount* i1) {
-	int mountPerBlock = disk -> blockSize / sizeof(struct Mount);
-	int blockNo = base + inumber / mountPerBlock;
-	int offsetNo = inumber % mountPerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(temp + offsetNo * sizeof(struct Mount), (unsigned char*)i1, sizeof(struct Mount));
-	writeBlock(disk, blockNo, temp);
+//Journaled disks commit instead, which writes the data first anyway.
+int syncDisk(struct Disk* disk) {
+	if(disk -> journal != NULL)
+		return journalCommit(disk) < 0 ? -1 : 1; //Journal write failed
+	if(disk -> cache != NULL)
+		flushCache(disk -> cache);
+	syncData(disk);
+	return 1;
 }
 
-void getDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1) {
-	int directoryPerBlock = disk -> blockSize / sizeof(struct Directory);
-	int blockNo = base + inumber / directoryPerBlock;
-	int offsetNo = inumber % directoryPerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(i1, (struct Directory*)(temp + offsetNo * sizeof(struct Directory)), sizeof(struct Directory));
+//Only the pages covering blocks written since the last sync are flushed.
+void syncData(struct Disk* disk) {
+	if(disk -> fd < 0 || disk -> dirtyLow == -1)
+		return;
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t low = (size_t)disk -> dirtyLow * disk -> blockSize / pageSize * pageSize;
+	size_t high = ((size_t)disk -> dirtyHigh + 1) * disk -> blockSize;
+	msync(disk -> buffer + low, high - low, MS_SYNC);
+	disk -> dirtyLow = disk -> dirtyHigh = -1;
 }
 
-void setDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1) {
-	int directoryPerBlock = disk -> blockSize / sizeof(struct Directory);
-	int blockNo = base + inumber / directoryPerBlock;
-	int offsetNo = inumber % directoryPerBlock;
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-	readBlock(disk, blockNo, temp);
-	memcpy(temp + offsetNo * sizeof(struct Directory), (unsigned char*)i1, sizeof(struct Directory));
-	writeBlock(disk, blockNo, temp);
+//Returns -1 if the last journal commit failed; the disk is closed anyway.
+int closeDisk(struct Disk* disk) {
+	int i, result = 1;
+	free(disk -> dentries);
+	free(disk -> mountNames);
+	disk -> dentries = NULL;
+	disk -> mountNames = NULL;
+	disk -> mountNameCount = -1;
+	pthread_rwlock_destroy(&disk -> namespaceLock);
+	for(i = 0; i < INODE_LOCKS; i += 1)
+		pthread_rwlock_destroy(&disk -> inodeLocks[i]);
+	for(i = 0; i < ENTRY_LOCKS; i += 1)
+		pthread_mutex_destroy(&disk -> entryLocks[i]);
+	pthread_mutex_destroy(&disk -> mountLock);
+	pthread_mutex_destroy(&disk -> dedupLock);
+	if(disk -> fd < 0) {
+		munmap(disk -> buffer, (size_t)disk -> totalSize * (size_t)pow(2, 20));
+		disk -> buffer = NULL;
+		return result;
+	}
+	if(disk -> journal != NULL)
+		result = journalClose(disk);
+	else
+		syncDisk(disk);
+	if(disk -> cache != NULL)
+		destroyCache(disk -> cache);
+	disk -> cache = NULL;
+	munmap(disk -> buffer, (size_t)disk -> totalSize * (size_t)pow(2, 20));
+	close(disk -> fd);
+	disk -> fd = -1;
+	disk -> buffer = NULL;
+	return result;
 }
 
-void pathResolution(unsigned char* buffer1, struct Path* path, struct Disk* rootDisk) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Mount* m1 = (struct Mount*)malloc(sizeof(struct Mount));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* buffer = (unsigned char*)malloc(sizeof(buffer1));
-	strcpy(buffer, buffer1);
+//Gives the memory behind a page aligned range back: memory disks drop the
+//pages, images get a hole punched. Either way the range reads as zeros.
+void discardBytes(struct Disk* disk, off_t offset, off_t length) {
+	if(disk -> fd < 0)
+		madvise(disk -> buffer + offset, length, MADV_DONTNEED);
+	else
+		fallocate(disk -> fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
 
-	int i, j, blockNo, offsetNo, flag;
-	for(i = 0; i < strlen(buffer); i += 1) {
-		if(buffer[i] == '\\')
-			buffer[i] = ' ';
+//Zeroes count blocks from first. The whole pages among them are discarded
+//rather than written, so formatting a disk does not touch its memory.
+void zeroBlocks(struct Disk* disk, int first, int count) {
+	off_t pageSize = sysconf(_SC_PAGESIZE);
+	off_t low = ((off_t)first * disk -> blockSize + pageSize - 1) / pageSize * pageSize;
+	off_t high = (off_t)(first + count) * disk -> blockSize / pageSize * pageSize;
+	int i;
+	for(i = first; i < first + count; i += 1) {
+		if((off_t)i * disk -> blockSize >= low && (off_t)(i + 1) * disk -> blockSize <= high)
+			continue;
+		memset(borrowBlock(disk, i, BLOCK_WRITE), 0, disk -> blockSize);
+		returnBlock(disk, i);
 	}
-	char** args = lsh_split_line(buffer);
-	struct Disk* currDisk = rootDisk;
-	int currInumber = -1;
-
-	i = 0;
-	while(args[i] != NULL) {
-		getSuperBlock(currDisk, sb);
-		unsigned char* temp = (unsigned char*)malloc(currDisk -> blockSize);
+	if(low < high)
+		discardBytes(disk, low, high - low);
+}
 
-		if(currInumber == -1) {
-			flag = 0;
-			readBlock(currDisk, sb -> mountBitmap, temp);
-			for(j = 0; j < sb -> mountCount; j += 1) {
-				if(temp[j] == 0)
-					continue;
-				getMount(currDisk, sb -> mount, j, m1);
-				if(m1 -> magicNumber == VALID_MAGIC_NUMBER && strcmp(m1 -> diskName, args[i]) == 0) {
-					flag = 1;
-					currDisk = m1 -> location;
-					currInumber = -1;
-					break;
-				}
-			}
-			if(flag == 1) {
-				i += 1;
-				continue;
-			}
-			readBlock(currDisk, sb -> directoryBitmap, temp);
-			for(j = 0; j < sb -> directoryCount; j += 1) {
-				if(temp[j] == 0)
-					continue;
-				getDirectory(currDisk, sb -> directory, j, d1);
-				if(strcmp(d1 -> fileName, args[i]) == 0) {
-					flag = 1;
-					currInumber = d1 -> inumber;
-					break;
-				}
-			}
-			if(flag == 0) {
-				printf("Path is invalid\n");
-				path -> location = NULL;
-				path -> inumber = -1;
-				return;
-			}
-		}
-		else 
-			break;
+//Hands out a pointer into the disk itself instead of a copy. The block stays
+//borrowed until returnBlock; BLOCK_WRITE marks it dirty for the next sync.
+//Metadata blocks of image disks are served from the buffer cache instead.
+unsigned char* borrowBlock(struct Disk* disk, int blockNumber, int mode) {
+	__atomic_add_fetch(&disk -> pinned, 1, __ATOMIC_RELAXED);
+	statAdd(mode == BLOCK_WRITE ? &disk -> stats.blockWrites : &disk -> stats.blockReads, 1);
+	if(disk -> cache != NULL && blockNumber < disk -> cache -> limit)
+		return cacheBorrow(disk -> cache, blockNumber, mode);
+	if(mode == BLOCK_WRITE)
+		markDirty(disk, blockNumber, blockNumber);
+	return (disk -> buffer) + (size_t)blockNumber * (disk -> blockSize);
+}
 
-		i += 1;
-	}
-	path -> location = currDisk;
-	path -> inumber = currInumber;
+//Widens the range the next sync flushes to cover low through high.
+void markDirty(struct Disk* disk, int low, int high) {
+	int old = __atomic_load_n(&disk -> dirtyLow, __ATOMIC_RELAXED);
+	while((old == -1 || low < old) && !__atomic_compare_exchange_n(&disk -> dirtyLow, &old, low, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	old = __atomic_load_n(&disk -> dirtyHigh, __ATOMIC_RELAXED);
+	while(high > old && !__atomic_compare_exchange_n(&disk -> dirtyHigh, &old, high, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-void partition(unsigned char* buffer1, struct PseudoPath* path, struct Disk* rootDisk) {
-	unsigned char* buffer = (unsigned char*)malloc(sizeof(buffer1));
-	strcpy(buffer, buffer1);
-	int i;
-	struct Path* p1 = (struct Path*)malloc(sizeof(struct Path));
-	for(i = strlen(buffer) - 1; i >= 0; i -= 1) {
-		if(buffer[i] == '\\') {
-			buffer[i] = 0;
-			pathResolution(buffer, p1, rootDisk);
-			path -> location = p1 -> location;
-			strcpy(path -> fileName, buffer + i + 1);
-			return;
-		}
-	}
-	path -> location = rootDisk;
-	strcpy(path -> fileName, buffer);
+void returnBlock(struct Disk* disk, int blockNumber) {
+	__atomic_sub_fetch(&disk -> pinned, 1, __ATOMIC_RELAXED);
+	if(disk -> cache != NULL && blockNumber < disk -> cache -> limit)
+		cacheReturn(disk -> cache, blockNumber);
 }
 
-int createFile(struct Disk* disk, unsigned char name[10]) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//Borrows count blocks that follow each other on disk as one range, so a
+//run is copied at once. Only for blocks past the cached metadata, which
+//are mapped in order.
+unsigned char* borrowExtent(struct Disk* disk, int first, int count, int mode) {
+	__atomic_add_fetch(&disk -> pinned, 1, __ATOMIC_RELAXED);
+	statAdd(mode == BLOCK_WRITE ? &disk -> stats.blockWrites : &disk -> stats.blockReads, count);
+	if(mode == BLOCK_WRITE)
+		markDirty(disk, first, first + count - 1);
+	return (disk -> buffer) + (size_t)first * (disk -> blockSize);
+}
 
-	getSuperBlock(disk, sb);
-	readBlock(disk, sb -> directoryBitmap, temp);
-	int i;
-	for(i = 0; i < sb -> directoryCount; i += 1) {
-		if(temp[i] == 0)
-			continue;
-		getDirectory(disk, sb -> directory, i, d1);
-		if(strcmp(d1 -> fileName, name) == 0)
-			return -2; //Duplicate name
-	}
-	for(i = 0; i < sb -> inodeCount; i += 1) {
-		if(temp[i] == 1)
-			continue;
-		temp[i] = 1;
-		writeBlock(disk, sb -> inodeBitmap, temp);
-		writeBlock(disk, sb -> directoryBitmap, temp);
-		i1 -> isDirectory = 0;
-		i1 -> sizeofFile = 0;
-		setInode(disk, sb -> inode, i, i1);
-		strcpy(d1 -> fileName, name);
-		d1 -> inumber = i;
-		setDirectory(disk, sb -> directory, i, d1);
-		return 1;
-	}
-	return -1; //Space not available
+//Extents never sit in the metadata cache, so only the pin is dropped.
+void returnExtent(struct Disk* disk) {
+	__atomic_sub_fetch(&disk -> pinned, 1, __ATOMIC_RELAXED);
 }
 
-void releaseFile(struct Disk* disk, int inumber) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//Asks the kernel to start reading count blocks from first into the page
+//cache, so a sequential reader finds them there instead of faulting on
+//each page. Memory disks have nothing to read.
+void prefetchBlocks(struct Disk* disk, int first, int count) {
+	if(disk -> fd < 0 || count <= 0)
+		return;
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t low = (size_t)first * disk -> blockSize / pageSize * pageSize;
+	size_t high = ((size_t)first + count) * disk -> blockSize;
+	madvise(disk -> buffer + low, high - low, MADV_WILLNEED);
+	statAdd(&disk -> stats.prefetchBlocks, count);
+}
 
-	getSuperBlock(disk, sb);
-	getInode(disk, sb -> inode, inumber, i1);
-	i1 -> sizeofFile = 0;
-	setInode(disk, sb -> inode, inumber, i1);
+void readBlock(struct Disk* disk, int blockNumber, unsigned char* data) {
+	memcpy(data, borrowBlock(disk, blockNumber, BLOCK_READ), disk -> blockSize);
+	returnBlock(disk, blockNumber);
+}
 
-	readBlock(disk, sb -> dataBitmap, temp);
-	int i;
-	for(i = 0; i < POINTERS_PER_INODE; i += 1) 
-		temp[i1 -> blockNumbers[i]] = 0;
-	writeBlock(disk, sb -> dataBitmap, temp);
+void writeBlock(struct Disk* disk, int blockNumber, unsigned char* data) {
+	memcpy(borrowBlock(disk, blockNumber, BLOCK_WRITE), data, disk -> blockSize);
+	returnBlock(disk, blockNumber);
 }
 
-void removeFile(struct Disk* disk, int inumber) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//Lock order is namespaceLock, then an inode lock, then an entry lock. Block
+//and cache level state below them is protected by atomics and the cache's
+//own mutex, so readers of different files never wait on each other.
+pthread_rwlock_t* inodeLock(struct Disk* disk, int inumber) {
+	return &disk -> inodeLocks[inumber & (INODE_LOCKS - 1)];
+}
 
-	getSuperBlock(disk, sb);
-	releaseFile(disk, inumber);
-	readBlock(disk, sb -> inodeBitmap, temp);
-	temp[inumber] = 0;
-	writeBlock(disk, sb -> inodeBitmap, temp);
-	readBlock(disk, sb -> directoryBitmap, temp);
-	temp[inumber] = 0;
-	writeBlock(disk, sb -> directoryBitmap, temp);
+pthread_mutex_t* entryLock(struct Disk* disk, int slot) {
+	return &disk -> entryLocks[slot & (ENTRY_LOCKS - 1)];
+}
+//--------------------------------------------//
 
+//-------------IO ENGINE CODE-----------------//
+#ifndef MYFS_NO_URING
+//The rings are shared with the kernel: it moves sqHead and cqTail, this
+//side moves sqTail and cqHead, so each index is published with a release
+//store and read with an acquire load.
+int uringSetup(struct IoEngine* io, int depth) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	io -> ringFd = syscall(__NR_io_uring_setup, depth, &params);
+	if(io -> ringFd < 0)
+		return -1; //Not supported here
+	io -> entries = params.sq_entries;
+	io -> sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	io -> cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	io -> sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	io -> sqRing = mmap(NULL, io -> sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io -> ringFd, IORING_OFF_SQ_RING);
+	io -> cqRing = mmap(NULL, io -> cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io -> ringFd, IORING_OFF_CQ_RING);
+	io -> sqes = mmap(NULL, io -> sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io -> ringFd, IORING_OFF_SQES);
+	if(io -> sqRing == MAP_FAILED || io -> cqRing == MAP_FAILED || io -> sqes == MAP_FAILED) {
+		if(io -> sqRing != MAP_FAILED)
+			munmap(io -> sqRing, io -> sqRingSize);
+		if(io -> cqRing != MAP_FAILED)
+			munmap(io -> cqRing, io -> cqRingSize);
+		if(io -> sqes != MAP_FAILED)
+			munmap(io -> sqes, io -> sqesSize);
+		close(io -> ringFd);
+		return -1;
+	}
+	unsigned char* sq = (unsigned char*)io -> sqRing;
+	unsigned char* cq = (unsigned char*)io -> cqRing;
+	io -> sqHead = (unsigned*)(sq + params.sq_off.head);
+	io -> sqTail = (unsigned*)(sq + params.sq_off.tail);
+	io -> sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	io -> sqArray = (unsigned*)(sq + params.sq_off.array);
+	io -> cqHead = (unsigned*)(cq + params.cq_off.head);
+	io -> cqTail = (unsigned*)(cq + params.cq_off.tail);
+	io -> cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	io -> cqes = cq + params.cq_off.cqes;
+	io -> queued = 0;
+	return 1;
 }
 
-int writeFile(struct Disk* disk, int inumber, unsigned char* buffer, int len) {
-	releaseFile(disk, inumber);
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//Passes the queued sqes to the kernel and waits for at least wait
+//completions, which are then handed to their done callbacks.
+void uringEnter(struct IoEngine* io, unsigned wait) {
+	int submitted = syscall(__NR_io_uring_enter, io -> ringFd, io -> queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if(submitted > 0)
+		io -> queued -= submitted;
+	else if(submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		//The ring is broken: run what is still queued by hand.
+		unsigned tail = *io -> sqTail;
+		for(; io -> queued > 0; io -> queued -= 1) {
+			struct io_uring_sqe* sqe = (struct io_uring_sqe*)io -> sqes + io -> sqArray[(tail - io -> queued) & *io -> sqMask];
+			struct IoRequest* request = (struct IoRequest*)(uintptr_t)sqe -> user_data;
+			request -> result = ioRun(request);
+			io -> inFlight -= 1;
+			if(request -> done != NULL)
+				request -> done(request);
+		}
+		__atomic_store_n(io -> sqHead, tail, __ATOMIC_RELEASE);
+	}
+	unsigned head = *io -> cqHead;
+	while(head != __atomic_load_n(io -> cqTail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = (struct io_uring_cqe*)io -> cqes + (head & *io -> cqMask);
+		struct IoRequest* request = (struct IoRequest*)(uintptr_t)cqe -> user_data;
+		request -> result = cqe -> res;
+		head += 1;
+		__atomic_store_n(io -> cqHead, head, __ATOMIC_RELEASE);
+		io -> inFlight -= 1;
+		if(request -> done != NULL)
+			request -> done(request);
+	}
+}
 
-	getSuperBlock(disk, sb);
-	if(len > disk -> blockSize * POINTERS_PER_INODE)
-		return -1; //Size exceeded
-	int i, blocksRequired = len / disk -> blockSize, j = 0;
-	if(len % disk -> blockSize != 0)
-		blocksRequired += 1;
-	readBlock(disk, sb -> dataBitmap, temp);
-	for(i = 0; i < sb -> dataCount; i += 1) {
-		if(j == blocksRequired)
-			break;
-		if(temp[i] == 0)
-			j += 1;
+void uringSubmit(struct IoEngine* io, struct IoRequest* request) {
+	//Never more in flight than the completion ring is sure to hold.
+	while((unsigned)io -> inFlight >= io -> entries)
+		uringEnter(io, 1);
+	unsigned tail = *io -> sqTail, index = tail & *io -> sqMask;
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)io -> sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe -> fd = request -> fd;
+	if(request -> vectors != NULL) {
+		sqe -> opcode = request -> write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe -> addr = (uintptr_t)request -> vectors;
+		sqe -> len = request -> vectorCount;
 	}
-	if(j != blocksRequired)
-		return -2; // Blocks not available
-	getInode(disk, sb -> inode, inumber, i1);
-	i1 -> sizeofFile = len;
-	j = 0;
-	for(i = 0; i < sb -> dataCount; i += 1) {
-		if(j == blocksRequired)
-			break;
-		if(temp[i] == 1)
-			continue;
-		temp[i] = 1; //write this
-		i1 -> blockNumbers[j] = i;
-		writeBlock(disk, sb -> data + i, buffer + j * disk -> blockSize);
-		j += 1;
+	else {
+		sqe -> opcode = request -> write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe -> addr = (uintptr_t)request -> buffer;
+		sqe -> len = request -> length;
 	}
-	writeBlock(disk, sb -> dataBitmap, temp);	
-	setInode(disk, sb -> inode, inumber, i1);
-	return 1;
+	sqe -> off = request -> offset;
+	sqe -> user_data = (uintptr_t)request;
+	io -> sqArray[index] = index;
+	__atomic_store_n(io -> sqTail, tail + 1, __ATOMIC_RELEASE);
+	io -> queued += 1;
+	io -> inFlight += 1;
 }
+#endif
 
-void readFile(struct Disk* disk, int inumber, unsigned char* buffer) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//Moves a request's bytes with plain system calls, for the thread pool and
+//for a broken ring. Returns bytes moved or -errno.
+ssize_t ioRun(struct IoRequest* request) {
+	ssize_t result;
+	if(request -> vectors != NULL)
+		result = request -> write ? pwritev(request -> fd, request -> vectors, request -> vectorCount, request -> offset)
+			: preadv(request -> fd, request -> vectors, request -> vectorCount, request -> offset);
+	else
+		result = request -> write ? pwrite(request -> fd, request -> buffer, request -> length, request -> offset)
+			: pread(request -> fd, request -> buffer, request -> length, request -> offset);
+	return result < 0 ? -errno : result;
+}
 
-	getSuperBlock(disk, sb);
-	getInode(disk, sb -> inode, inumber, i1);
-//	printf("%d\n", i1 -> sizeofFile);
-	int i, blocksRequired = i1 -> sizeofFile / disk -> blockSize, j;
-	if(i1 -> sizeofFile % disk -> blockSize != 0)
-		blocksRequired += 1;
-	for(i = 0; i < blocksRequired; i += 1) {
-		readBlock(disk, sb -> data + i1 -> blockNumbers[i], temp);
-		j = min(disk -> blockSize, i1 -> sizeofFile - i * disk -> blockSize);
-		strncpy(buffer + i * disk -> blockSize, temp, j);
+void* ioWorker(void* arg) {
+	struct IoEngine* io = (struct IoEngine*)arg;
+	pthread_mutex_lock(&io -> lock);
+	while(1) {
+		while(io -> queue == NULL && !io -> stopping)
+			pthread_cond_wait(&io -> work, &io -> lock);
+		if(io -> queue == NULL)
+			break;
+		struct IoRequest* request = io -> queue;
+		io -> queue = request -> next;
+		if(io -> queue == NULL)
+			io -> queueTail = NULL;
+		pthread_mutex_unlock(&io -> lock);
+		request -> result = ioRun(request);
+		pthread_mutex_lock(&io -> lock);
+		request -> next = io -> completed;
+		io -> completed = request;
+		pthread_cond_signal(&io -> finished);
 	}
+	pthread_mutex_unlock(&io -> lock);
+	return NULL;
 }
 
-int mountFileSystem(struct Disk* disk, struct Disk* diskMount, char name[10]) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Mount* m1 = (struct Mount*)malloc(sizeof(struct Mount));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
+//An engine is used by one thread at a time; the buffer cache calls it
+//with its lock held.
+struct IoEngine* createIoEngine(int depth) {
+	struct IoEngine* io = (struct IoEngine*)malloc(sizeof(struct IoEngine));
+	io -> inFlight = 0;
+	io -> uring = 0;
+#ifndef MYFS_NO_URING
+	io -> uring = uringSetup(io, depth) == 1;
+#endif
+	if(io -> uring)
+		return io;
+	int i;
+	pthread_mutex_init(&io -> lock, NULL);
+	pthread_cond_init(&io -> work, NULL);
+	pthread_cond_init(&io -> finished, NULL);
+	io -> queue = io -> queueTail = io -> completed = NULL;
+	io -> stopping = 0;
+	for(i = 0; i < IO_THREADS; i += 1)
+		pthread_create(&io -> threads[i], NULL, ioWorker, io);
+	return io;
+}
+
+void destroyIoEngine(struct IoEngine* io) {
+	ioWait(io);
+#ifndef MYFS_NO_URING
+	if(io -> uring) {
+		munmap(io -> sqes, io -> sqesSize);
+		munmap(io -> cqRing, io -> cqRingSize);
+		munmap(io -> sqRing, io -> sqRingSize);
+		close(io -> ringFd);
+		free(io);
+		return;
+	}
+#endif
+	int i;
+	pthread_mutex_lock(&io -> lock);
+	io -> stopping = 1;
+	pthread_cond_broadcast(&io -> work);
+	pthread_mutex_unlock(&io -> lock);
+	for(i = 0; i < IO_THREADS; i += 1)
+		pthread_join(io -> threads[i], NULL);
+	pthread_cond_destroy(&io -> finished);
+	pthread_cond_destroy(&io -> work);
+	pthread_mutex_destroy(&io -> lock);
+	free(io);
+}
 
-	getSuperBlock(disk, sb);
-	readBlock(disk, sb -> mountBitmap, temp);
+//Starts count requests. They complete in any order; each one's done
+//callback runs from ioWait, in the caller's thread.
+void ioSubmit(struct IoEngine* io, struct IoRequest** requests, int count) {
 	int i;
-	for(i = 0; i < sb -> mountCount; i += 1) {
-		if(temp[i] == 0)
-			continue;
-		getMount(disk, sb -> mount, i, m1);
-		if(m1 -> location == diskMount)
-			return -2; //Duplicate exists
+#ifndef MYFS_NO_URING
+	if(io -> uring) {
+		for(i = 0; i < count; i += 1)
+			uringSubmit(io, requests[i]);
+		uringEnter(io, 0);
+		return;
 	}
-	for(i = 0; i < sb -> mountCount; i += 1) {
-		if(temp[i] == 1)
-			continue;
-		temp[i] = 1;
-		writeBlock(disk, sb -> mountBitmap, temp);
-		strcpy(m1 -> diskName, name);
-		m1 -> location = diskMount;
-		m1 -> magicNumber = VALID_MAGIC_NUMBER;
-		setMount(disk, sb -> mount, i, m1);
-		return 1;
+#endif
+	pthread_mutex_lock(&io -> lock);
+	for(i = 0; i < count; i += 1) {
+		requests[i] -> next = NULL;
+		if(io -> queueTail == NULL)
+			io -> queue = requests[i];
+		else
+			io -> queueTail -> next = requests[i];
+		io -> queueTail = requests[i];
 	}
-	return -1; // Space not available
+	io -> inFlight += count;
+	pthread_cond_broadcast(&io -> work);
+	pthread_mutex_unlock(&io -> lock);
 }
 
-int renameFileSystem(struct Disk* disk, struct Disk* diskMount, char name[10]) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Mount* m1 = (struct Mount*)malloc(sizeof(struct Mount));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-
-	getSuperBlock(disk, sb);
-	readBlock(disk, sb -> mountBitmap, temp);
-	int i;
-	for(i = 0; i < sb -> mountCount; i += 1) {
-		if(temp[i] == 0)
-			continue;
-		getMount(disk, sb -> mount, i, m1);
-		if(m1 -> location != diskMount && strcmp(m1 -> diskName, name) == 0)
-			return -1; //Duplicate will occur
+//Returns once every submitted request has completed.
+void ioWait(struct IoEngine* io) {
+#ifndef MYFS_NO_URING
+	if(io -> uring) {
+		while(io -> inFlight > 0)
+			uringEnter(io, 1);
+		return;
 	}
-	for(i = 0; i < sb -> mountCount; i += 1) {
-		if(temp[i] == 0)
-			continue;
-		getMount(disk, sb -> mount, i, m1);
-		if(m1 -> location == diskMount) {
-			strcpy(m1 -> diskName, name);
-			setMount(disk, sb -> mount, i, m1);
-			return 1;
+#endif
+	pthread_mutex_lock(&io -> lock);
+	while(io -> inFlight > 0) {
+		while(io -> completed == NULL)
+			pthread_cond_wait(&io -> finished, &io -> lock);
+		struct IoRequest* done = io -> completed;
+		io -> completed = NULL;
+		pthread_mutex_unlock(&io -> lock);
+		while(done != NULL) {
+			struct IoRequest* next = done -> next;
+			io -> inFlight -= 1;
+			if(done -> done != NULL)
+				done -> done(done);
+			done = next;
 		}
+		pthread_mutex_lock(&io -> lock);
 	}
-	return -2; //disk not found
+	pthread_mutex_unlock(&io -> lock);
 }
+//--------------------------------------------//
 
-void ls(struct Disk* disk) {
-	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
-	struct Inode* i1 = (struct Inode*)malloc(sizeof(struct Inode));
-	struct Directory* d1 = (struct Directory*)malloc(sizeof(struct Directory));
-	unsigned char* temp = (unsigned char*)malloc(disk -> blockSize * sizeof(unsigned char));
-
-	getSuperBlock(disk, sb);
-	readBlock(disk, sb -> directoryBitmap, temp);
+//-------------BUFFER CACHE CODE--------------//
+//The superblock is loaded up front and kept resident for the cache's lifetime.
+struct BufferCache* createCache(int fd, int blockSize, int limit, int frameCount) {
+	struct BufferCache* cache = (struct BufferCache*)malloc(sizeof(struct BufferCache));
+	cache -> fd = fd;
+	cache -> blockSize = blockSize;
+	cache -> limit = limit;
+	cache -> frameCount = frameCount;
+	cache -> frames = (struct CacheFrame*)malloc(frameCount * sizeof(struct CacheFrame));
+	cache -> bucketCount = 1;
+	while(cache -> bucketCount < 2 * frameCount)
+		cache -> bucketCount *= 2;
+	cache -> buckets = (int*)malloc(cache -> bucketCount * sizeof(int));
+	cache -> hand = 0;
+	cache -> hits = cache -> misses = cache -> evictions = cache -> writebacks = cache -> flushes = 0;
+	cache -> dirtyCount = cache -> journaled = 0;
+	cache -> io = createIoEngine(IO_QUEUE_DEPTH);
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&cache -> lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 	int i;
-	for(i = 0; i < sb -> directoryCount; i += 1) {
-		if(temp[i] == 0)
-			continue;
-		getDirectory(disk, sb -> directory, i, d1);
-		getInode(disk, sb -> inode, i, i1);
-		printf("%d %s %d\n", i, d1 -> fileName, i1 -> sizeofFile);
+	for(i = 0; i < cache -> bucketCount; i += 1)
+		cache -> buckets[i] = -1;
+	for(i = 0; i < frameCount; i += 1) {
+		cache -> frames[i].blockNumber = -1;
+		cache -> frames[i].pins = cache -> frames[i].dirty = 0;
+		cache -> frames[i].referenced = cache -> frames[i].resident = 0;
+		cache -> frames[i].next = -1;
+		cache -> frames[i].data = (unsigned char*)aligned_alloc(CACHE_LINE, blockSize);
 	}
+	cacheBorrow(cache, 0, BLOCK_READ);
+	cacheReturn(cache, 0);
+	cache -> frames[cache -> buckets[0]].resident = 1;
+	return cache;
 }
-//--------------------------------------------//
 
-int main() {
-	struct Disk* root = (struct Disk*)malloc(sizeof(struct Disk));
-	createDisk(root, 100, 2048);
-	createFileSystem(root);
-	struct Path* p1 = (struct Path*)malloc(sizeof(struct Path));
-	struct Path* p2 = (struct Path*)malloc(sizeof(struct Path));
-	struct PseudoPath* p3 = (struct PseudoPath*)malloc(sizeof(struct PseudoPath));
-	unsigned char* buffer;
+void destroyCache(struct BufferCache* cache) {
+	flushCache(cache);
+	int i;
+	for(i = 0; i < cache -> frameCount; i += 1)
+		free(cache -> frames[i].data);
+	free(cache -> frames);
+	free(cache -> buckets);
+	destroyIoEngine(cache -> io);
+	pthread_mutex_destroy(&cache -> lock);
+	free(cache);
+}
 
-	unsigned char* line;
-	char** args;
-	int i, j;
+int cacheLookup(struct BufferCache* cache, int blockNumber) {
+	int f = cache -> buckets[blockNumber & (cache -> bucketCount - 1)];
+	while(f != -1 && cache -> frames[f].blockNumber != blockNumber)
+		f = cache -> frames[f].next;
+	return f;
+}
+
+void cacheUnlink(struct BufferCache* cache, int f) {
+	int* link = &cache -> buckets[cache -> frames[f].blockNumber & (cache -> bucketCount - 1)];
+	while(*link != f)
+		link = &cache -> frames[*link].next;
+	*link = cache -> frames[f].next;
+	cache -> frames[f].blockNumber = -1;
+}
+
+//Every frame is pinned, so the cache grows instead of failing the borrow.
+void growCache(struct BufferCache* cache) {
+	int i, oldCount = cache -> frameCount;
+	cache -> frameCount *= 2;
+	cache -> frames = (struct CacheFrame*)realloc(cache -> frames, cache -> frameCount * sizeof(struct CacheFrame));
+	for(i = oldCount; i < cache -> frameCount; i += 1) {
+		cache -> frames[i].blockNumber = -1;
+		cache -> frames[i].pins = cache -> frames[i].dirty = 0;
+		cache -> frames[i].referenced = cache -> frames[i].resident = 0;
+		cache -> frames[i].next = -1;
+		cache -> frames[i].data = (unsigned char*)aligned_alloc(CACHE_LINE, cache -> blockSize);
+	}
+	free(cache -> buckets);
+	while(cache -> bucketCount < 2 * cache -> frameCount)
+		cache -> bucketCount *= 2;
+	cache -> buckets = (int*)malloc(cache -> bucketCount * sizeof(int));
+	for(i = 0; i < cache -> bucketCount; i += 1)
+		cache -> buckets[i] = -1;
+	for(i = 0; i < oldCount; i += 1) {
+		int bucket = cache -> frames[i].blockNumber & (cache -> bucketCount - 1);
+		if(cache -> frames[i].blockNumber == -1)
+			continue;
+		cache -> frames[i].next = cache -> buckets[bucket];
+		cache -> buckets[bucket] = i;
+	}
+	cache -> hand = oldCount;
+}
+
+//CLOCK: referenced frames get a second chance, pinned and resident ones are
+//skipped. So are dirty ones of a journaled cache, until they are committed.
+int cacheVictim(struct BufferCache* cache) {
+	int scanned;
+	for(scanned = 0; scanned < 2 * cache -> frameCount; scanned += 1) {
+		int f = cache -> hand;
+		struct CacheFrame* frame = &cache -> frames[f];
+		cache -> hand = (cache -> hand + 1) % cache -> frameCount;
+		if(frame -> blockNumber == -1)
+			return f;
+		if(frame -> pins > 0 || frame -> resident || (frame -> dirty && cache -> journaled))
+			continue;
+		if(frame -> referenced) {
+			frame -> referenced = 0;
+			continue;
+		}
+		return f;
+	}
+	growCache(cache);
+	return cacheVictim(cache);
+}
+
+unsigned char* cacheBorrow(struct BufferCache* cache, int blockNumber, int mode) {
+	pthread_mutex_lock(&cache -> lock);
+	int f = cacheLookup(cache, blockNumber);
+	if(f != -1)
+		cache -> hits += 1;
+	else {
+		cache -> misses += 1;
+		f = cacheVictim(cache);
+		if(cache -> frames[f].blockNumber != -1) {
+			cache -> evictions += 1;
+			if(cache -> frames[f].dirty)
+				flushCache(cache); //write back the whole dirty set in one batch
+			cacheUnlink(cache, f);
+		}
+		struct CacheFrame* frame = &cache -> frames[f];
+		if(pread(cache -> fd, frame -> data, cache -> blockSize, (off_t)blockNumber * cache -> blockSize) != cache -> blockSize)
+			memset(frame -> data, 0, cache -> blockSize);
+		frame -> blockNumber = blockNumber;
+		frame -> dirty = 0;
+		int bucket = blockNumber & (cache -> bucketCount - 1);
+		frame -> next = cache -> buckets[bucket];
+		cache -> buckets[bucket] = f;
+	}
+	struct CacheFrame* frame = &cache -> frames[f];
+	frame -> pins += 1;
+	frame -> referenced = 1;
+	if(mode == BLOCK_WRITE && frame -> dirty == 0) {
+		frame -> dirty = 1;
+		__atomic_add_fetch(&cache -> dirtyCount, 1, __ATOMIC_RELAXED);
+	}
+	unsigned char* data = frame -> data;
+	pthread_mutex_unlock(&cache -> lock);
+	return data;
+}
+
+void cacheReturn(struct BufferCache* cache, int blockNumber) {
+	pthread_mutex_lock(&cache -> lock);
+	int f = cacheLookup(cache, blockNumber);
+	if(f != -1)
+		cache -> frames[f].pins -= 1;
+	pthread_mutex_unlock(&cache -> lock);
+}
+
+int compareFrames(const void* a, const void* b) {
+	return (*(struct CacheFrame**)a) -> blockNumber - (*(struct CacheFrame**)b) -> blockNumber;
+}
+
+//Completion of a write back of one frame or of a run of them. Frames that
+//failed to write stay dirty.
+void frameWritten(struct IoRequest* request) {
+	struct CacheFrame** frames = (struct CacheFrame**)request -> context;
+	struct BufferCache* cache = (struct BufferCache*)request -> owner;
+	int i, count = request -> vectors == NULL ? 1 : request -> vectorCount;
+	if(request -> result != (ssize_t)request -> length)
+		return;
+	for(i = 0; i < count; i += 1) {
+		if(frames[i] -> pins == 0) {
+			frames[i] -> dirty = 0;
+			__atomic_sub_fetch(&cache -> dirtyCount, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+//Writes every dirty frame back as one batch, in block order. Frames of
+//neighbouring blocks go out together as one vectored write. Frames still
+//borrowed stay dirty, since their owner may not be done modifying them.
+void flushCache(struct BufferCache* cache) {
+	pthread_mutex_lock(&cache -> lock);
+	size_t mark = arenaMark();
+	struct CacheFrame** dirty = (struct CacheFrame**)arenaAlloc(cache -> frameCount * sizeof(struct CacheFrame*));
+	int i, count = 0;
+	for(i = 0; i < cache -> frameCount; i += 1) {
+		if(cache -> frames[i].blockNumber != -1 && cache -> frames[i].dirty)
+			dirty[count++] = &cache -> frames[i];
+	}
+	qsort(dirty, count, sizeof(struct CacheFrame*), compareFrames);
+	struct IoRequest* requests = (struct IoRequest*)arenaAlloc(count * sizeof(struct IoRequest));
+	struct IoRequest** batch = (struct IoRequest**)arenaAlloc(count * sizeof(struct IoRequest*));
+	struct iovec* vectors = (struct iovec*)arenaAlloc(count * sizeof(struct iovec));
+	int n, runs = 0;
+	for(i = 0; i < count; i += n) {
+		for(n = 1; i + n < count && n < IO_MAX_VECTORS && dirty[i + n] -> blockNumber == dirty[i] -> blockNumber + n; n += 1) {
+			vectors[i + n].iov_base = dirty[i + n] -> data;
+			vectors[i + n].iov_len = cache -> blockSize;
+		}
+		vectors[i].iov_base = dirty[i] -> data;
+		vectors[i].iov_len = cache -> blockSize;
+		struct IoRequest* request = &requests[runs];
+		request -> write = 1;
+		request -> fd = cache -> fd;
+		request -> buffer = dirty[i] -> data;
+		request -> length = (size_t)n * cache -> blockSize;
+		request -> vectors = n > 1 ? &vectors[i] : NULL;
+		request -> vectorCount = n;
+		request -> offset = (off_t)dirty[i] -> blockNumber * cache -> blockSize;
+		request -> done = frameWritten;
+		request -> owner = cache;
+		request -> context = &dirty[i];
+		batch[runs++] = request;
+	}
+	ioSubmit(cache -> io, batch, runs);
+	ioWait(cache -> io);
+	cache -> writebacks += count;
+	if(count > 0)
+		cache -> flushes += 1;
+	arenaReset(mark);
+	pthread_mutex_unlock(&cache -> lock);
+}
+
+void printCacheStats(struct BufferCache* cache) {
+	pthread_mutex_lock(&cache -> lock);
+	int i, used = 0, dirty = 0;
+	for(i = 0; i < cache -> frameCount; i += 1) {
+		used += cache -> frames[i].blockNumber != -1;
+		dirty += cache -> frames[i].blockNumber != -1 && cache -> frames[i].dirty;
+	}
+	long long lookups = cache -> hits + cache -> misses;
+	printf("frames %d used %d dirty %d\n", cache -> frameCount, used, dirty);
+	printf("hits %lld misses %lld hit rate %.2f%%\n", cache -> hits, cache -> misses, lookups == 0 ? 0.0 : 100.0 * cache -> hits / lookups);
+	printf("evictions %lld writebacks %lld flushes %lld\n", cache -> evictions, cache -> writebacks, cache -> flushes);
+	printf("io %s\n", cache -> io -> uring ? "io_uring" : "thread pool");
+	pthread_mutex_unlock(&cache -> lock);
+}
+//--------------------------------------------//
+
+//-------------FILE SYSTEM TEMPLATE-----------//
+#define POINTERS_PER_INODE 5 // Must be >= 5
+#define INDIRECT_LEVELS 3
+#define NULL_BLOCK -1
+#define CLEAR_BLOCK -2 //handed to bmap to unmap a block
+#define COMPRESSED_MARK -3 //see storeChunk
+#define FINGERPRINT_MAX_PROBE 32 //blocks that would land further from home are not indexed
+#define REF_INDEXED 0x80000000u //refcount flag: the block is in the fingerprint index
+
+//Zero in any of the sizing fields picks its default.
+struct FormatOptions {
+	int compress; //files created on the disk are compressed
+	int dedup; //reserve a refcount table and a fingerprint index
+	long long bytesPerInode; //disk bytes per inode, derived from fileSize when 0
+	int maxMounts;
+	long long fileSize; //expected size of a file in bytes
+};
+#define DEFAULT_FILE_SIZE 4096
+#define DEFAULT_MAX_MOUNTS 64
+#define MAX_TABLE_SHARE 4 //the inode tables, and the mount table, each get at most 1/4 of the disk
+#define MIN_BLOCK_SIZE 512 //bitmaps are scanned in 64-bit words
+#define MAX_BLOCK_SIZE 65536
+#define VALID_MAGIC_NUMBER 1234
+#define FORMAT_VERSION 3 //bumped whenever a record or the region order changes
+
+//Free slots of each table and where the next search for one starts. They
+//live at the end of the superblock and change with every allocation and
+//free, so they are only touched atomically in place (see borrowSpace) and
+//getSuperBlock leaves them out.
+struct SpaceCounters {
+	int freeInodes, freeMounts, freeData;
+	int inodeHint, mountHint, dataHint;
+};
+
+struct SuperBlock {
+	int magicNumber;
+	int blockSize;
+	int totalBlockCount;
+	int inodeCount, mountCount, directoryCount, dataCount;
+	int inodeBitmap, mountBitmap, directoryBitmap, dataBitmap;
+	int inode, mount, directory, data;
+	int directoryIndex, indexBuckets;
+	int journal, journalBlocks; //0 blocks for disks without a journal
+	int compress; //files created on this disk are compressed
+	int dedup; //data blocks may be shared, see releaseBlock
+	int refcount, fingerprint, fingerprintBuckets; //0 without dedup
+	int version; //FORMAT_VERSION the disk was made with
+	int inodeSize, mountSize, directorySize; //record sizes, checked on attach
+	struct SpaceCounters space;
+};
+
+//Table records are padded to 32 or 64 bytes, so none straddles a cache line
+//or a block, and in the BLOCK_SHIFTS cases borrowRecord only shifts and
+//masks. Reserved bytes are written as zero and keep the size fixed when
+//fields are added.
+struct Inode {
+	int isDirectory;
+	int compressed;
+	long long sizeofFile;
+	long long storedSize; //bytes of data blocks a compressed file takes
+	int blockNumbers[POINTERS_PER_INODE];
+	int indirect[INDIRECT_LEVELS]; //single, double and triple indirect blocks
+	unsigned char reserved[8];
+};
+
+struct Mount {
+	struct Disk* location;
+	int magicNumber;
+	unsigned char diskName[STRING_SIZE];
+	unsigned char reserved[32 - sizeof(struct Disk*) - sizeof(int) - STRING_SIZE];
+};
+
+struct Directory {
+	int inumber;
+	int parent; //directory inumber, -1 for the disk root
+	unsigned char fileName[STRING_SIZE];
+	unsigned char reserved[32 - 2 * sizeof(int) - STRING_SIZE];
+};
+
+_Static_assert(sizeof(struct Inode) == 64, "inode record must stay 64 bytes");
+_Static_assert(sizeof(struct Mount) == 32, "mount record must stay 32 bytes");
+_Static_assert(sizeof(struct Directory) == 32, "directory record must stay 32 bytes");
+
+struct IndexEntry {
+	unsigned int hash;
+	int slot; //directory slot + 1, 0 when the bucket is empty
+};
+
+struct Fingerprint {
+	uint64_t hash;
+	int block; //data block + 1, 0 when the bucket is empty
+	int unused;
+};
+
+typedef uint32_t HashLanes __attribute__((vector_size(32)));
+
+struct Path {
+	struct Disk* location;
+	int inumber;
+};
+
+struct PseudoPath {
+	struct Disk* location;
+	int parent; //directory that will hold fileName
+	unsigned char fileName[PATH_SIZE];
+};
+
+void fillWithZero(unsigned char* buffer, int tot);
+int bitmapBlocks(int count, int blockSize);
+
+void createFileSystem(struct Disk* disk);
+void createFileSystemWith(struct Disk* disk, struct FormatOptions* options);
+long long fileFootprint(long long fileSize, int blockSize);
+int planInodes(struct SuperBlock* sb, struct FormatOptions* options);
+int layoutValid(struct SuperBlock* sb);
+int loadFileSystem(struct Disk* disk);
+void getSuperBlock(struct Disk* disk, struct SuperBlock* sb);
+struct SpaceCounters* borrowSpace(struct Disk* disk, int mode);
+void returnSpace(struct Disk* disk);
+inline void* borrowRecord(struct Disk* disk, int base, int index, int recordSize, int mode) __attribute__((always_inline));
+inline void returnRecord(struct Disk* disk, int base, int index, int recordSize) __attribute__((always_inline));
+void getInode(struct Disk* disk, int base, int inumber, struct Inode* i1);
+void setInode(struct Disk* disk, int base, int inumber, struct Inode* i1);
+void getMount(struct Disk* disk, int base, int inumber, struct Mount* i1);
+void setMount(struct Disk* disk, int base, int inumber, struct Mount* i1);
+void getDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1);
+void setDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1);
+
+int bitmapTest(struct Disk* disk, int start, int index);
+void bitmapSet(struct Disk* disk, int start, int index, int value);
+int bitmapNext(struct Disk* disk, int start, int count, int from, int value);
+int bitmapCountFree(struct Disk* disk, int start, int count, int enough);
+int bitmapAllocExtent(struct Disk* disk, int start, int count, int goal, int want, int* length);
+int bitmapClaimRange(struct Disk* disk, int start, int first, int n);
+int allocSlot(struct Disk* disk, int start, int count, int* free, int* hint);
+void freeSlot(struct Disk* disk, int start, int slot, int* free, int* hint);
+int freeDataCount(struct Disk* disk);
+int allocData(struct Disk* disk, struct SuperBlock* sb, int goal, int want, int* length);
+void unclaimData(struct Disk* disk, struct SuperBlock* sb, int first, int n);
+void freeDataBlock(struct Disk* disk, struct SuperBlock* sb, int block);
+void discardFreeChunks(struct Disk* disk, struct SuperBlock* sb, int low, int high);
+
+long long maxFileBlocks(int blockSize);
+long long pointerBlocksFor(long long blocks, int blockSize);
+int bmap(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long fileBlock, int newBlock);
+void freePointerTree(struct Disk* disk, struct SuperBlock* sb, int block, int depth);
+int trimPointerTree(struct Disk* disk, struct SuperBlock* sb, int block, int depth, long long base, long long keep);
+
+unsigned int nameHash(int parent, unsigned char* name);
+int indexLookup(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name);
+void indexInsert(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name, int slot);
+void indexRemove(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name);
+
+uint64_t blockHash(unsigned char* data, int len);
+int fingerprintProbe(struct Disk* disk, struct SuperBlock* sb, uint64_t hash, unsigned char* content, int* found);
+void fingerprintRemove(struct Disk* disk, struct SuperBlock* sb, uint64_t hash, int block);
+int dedupFind(struct Disk* disk, struct SuperBlock* sb, unsigned char* content, int own);
+void dedupIndex(struct Disk* disk, struct SuperBlock* sb, unsigned char* content, int block);
+int writableBlock(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long fileBlock, int block);
+void releaseBlock(struct Disk* disk, struct SuperBlock* sb, int block);
+
+int dentryLookup(struct Disk* disk, int parent, unsigned char* name, int* isDirectory);
+void dentryForget(struct Disk* disk, int parent, unsigned char* name);
+struct Disk* mountLookup(struct Disk* disk, unsigned char* name);
+unsigned char* mountNameOf(struct Disk* disk, struct Disk* diskMount, unsigned char* name);
+void mountCacheForget(struct Disk* disk);
+
+int resolvePath(char* buffer, struct Path* path, struct Disk* rootDisk, struct Path* cwd);
+void pathResolution(char* buffer, struct Path* path, struct Disk* rootDisk, struct Path* cwd);
+void partition(char* buffer, struct PseudoPath* path, struct Disk* rootDisk, struct Path* cwd);
+void printPath(struct Disk* rootDisk, struct Path* path);
+
+int isDirectoryInode(struct Disk* disk, int inumber);
+int validName(unsigned char* name);
+int createNode(struct Disk* disk, int parent, unsigned char* name, int isDirectory);
+int createFile(struct Disk* disk, int parent, unsigned char* name);
+int makeDirectory(struct Disk* disk, int parent, unsigned char* name);
+void releaseFile(struct Disk* disk, int inumber);
+void unlinkNode(struct Disk* disk, struct SuperBlock* sb, int inumber);
+int removeFile(struct Disk* disk, int inumber);
+int removeDirectory(struct Disk* disk, int inumber);
+int renameFile(struct Disk* disk, int inumber, int parent, unsigned char* name);
+int writeRange(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len);
+int readRange(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len);
+void readAhead(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, int len);
+int chunkBlocks(int blockSize);
+int chunkExtent(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, int* mark);
+int loadChunk(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, unsigned char* data, unsigned char* scratch);
+int storeChunk(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, unsigned char* data, int length, unsigned char* scratch);
+int writeChunks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len);
+int readChunks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len);
+int compressFile(struct Disk* disk, int inumber, int on);
+void setDiskCompression(struct Disk* disk, int on);
+int writeFileAt(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len);
+int readFileAt(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len);
+int appendFile(struct Disk* disk, int inumber, unsigned char* buffer, int len);
+int truncateFile(struct Disk* disk, int inumber, long long size);
+int truncateRange(struct Disk* disk, int inumber, long long size);
+int writeFile(struct Disk* disk, int inumber, unsigned char* buffer, int len);
+int readFile(struct Disk* disk, int inumber, unsigned char* buffer);
+long long sizeOfFile(struct Disk* disk, int inumber);
+long long freeableBlocks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1);
+int rewriteFits(struct Disk* disk, int inumber, long long size);
+
+int mountFileSystem(struct Disk* diskBase, struct Disk* diskMount, char name[10]);
+int unmountFileSystem(struct Disk* diskBase, struct Disk* diskMount);
+void unmountAll(struct Disk* diskBase);
+int syncAll(struct Disk* diskBase);
+
+void ls(struct Disk* disk, int directory);
+void printStats(struct Disk* rootDisk, int json);
+void resetStats(struct Disk* rootDisk);
+void printUsage(struct Disk* rootDisk);
+//--------------------------------------------//
+//-------------HOST IO TEMPLATE---------------//
+#define IO_CHUNK (1 << 20)
+#define IMPORT_THREADS 4
+
+struct ImportJob {
+	char hostPath[PATH_SIZE];
+	struct Disk* disk;
+	int inumber;
+	int result;
+};
+
+struct ImportQueue {
+	struct ImportJob* jobs;
+	int count, capacity;
+	int next; //first job no worker has taken yet
+	pthread_mutex_t lock;
+};
+
+int copyFile(struct Disk* diskFrom, int inumberFrom, struct Disk* diskTo, int inumberTo);
+int importFile(struct Disk* disk, int inumber, char* hostPath);
+int streamFile(struct Disk* disk, int inumber, int fd);
+int exportFile(struct Disk* disk, int inumber, char* hostPath);
+int queueImports(struct ImportQueue* queue, struct Disk* disk, int parent, char* hostDir);
+void* importWorker(void* arg);
+int importTree(struct Disk* disk, int parent, char* hostDir, int threads);
+//--------------------------------------------//
+//-------------FSCK TEMPLATE------------------//
+#define FSCK_MAX_THREADS 64
+#define FSCK_BATCH 4096 //slots per work item; a bitmap block covers whole batches
+//Block sizes are powers of two no smaller than MIN_BLOCK_SIZE (mkfs makes
+//no others and loadFileSystem refuses them), so this holds for every disk.
+_Static_assert(MIN_BLOCK_SIZE * 8 % FSCK_BATCH == 0, "a batch must not straddle bitmap blocks");
+#define FSCK_POINTER (1u << 24) //one reference as a pointer block, data references count below it
+
+//Problems found by checkFileSystem and what repair does about them.
+struct FsckReport {
+	long long files, directories, blocks;
+	long long badPointers; //past the data region: become holes
+	long long leaked; //allocated but not referenced: freed
+	long long lost; //referenced but free: allocated
+	long long crossLinked; //referenced twice where nothing may be shared: only reported
+	long long refcounts; //dedup reference counts that are off: corrected
+	long long slots; //inode bits that disagree with directory bits: follow the directory bit
+	long long badEntries; //entries without a live parent directory: only reported
+	long long entryCounts; //directories whose entry count is off: corrected
+	long long counters; //superblock free counters that are off: corrected
+};
+
+struct FsckJob {
+	struct Disk* disk;
+	struct SuperBlock sb;
+	int repair;
+	unsigned int* refs; //references to every data block, see FSCK_POINTER
+	int* entries; //entries naming every inode as their parent
+	int phase; //1 walks the inodes, 2 checks blocks and directories against the walk
+	int batches;
+	int next; //first batch no worker has taken yet
+	struct FsckReport report;
+	pthread_mutex_t lock;
+};
+
+long long checkFileSystem(struct Disk* disk, int repair, int threads, struct FsckReport* report);
+void* fsckWorker(void* arg);
+void fsckInodes(struct FsckJob* job, struct FsckReport* report, int first);
+void fsckBlocks(struct FsckJob* job, struct FsckReport* report, int first);
+int fsckReference(struct FsckJob* job, struct FsckReport* report, int block, unsigned int amount);
+void fsckTree(struct FsckJob* job, struct FsckReport* report, int inumber, int block, int depth);
+void fsckRefcount(struct FsckJob* job, struct FsckReport* report, int block, unsigned int expected, int mayIndex);
+long long fsckUnfixable(struct FsckReport* report);
+void printFsckReport(struct FsckReport* report, double seconds);
+//--------------------------------------------//
+//-------------FILE SYSTEM CODE---------------//
+void fillWithZero(unsigned char* buffer, int tot) {
+	int i;
+	for(i = 0; i < tot; i += 1)
+		buffer[i] = 0;
+}
+
+int bitmapBlocks(int count, int blockSize) {
+	int bitsPerBlock = blockSize * 8;
+	return (count + bitsPerBlock - 1) / bitsPerBlock;
+}
+
+void createFileSystem(struct Disk* disk) {
+	struct FormatOptions options = {0, 0, 0, 0, 0};
+	createFileSystemWith(disk, &options);
+}
+
+//Disk bytes a file of fileSize takes: its data blocks, the pointer blocks
+//that map them and its inode and directory records.
+long long fileFootprint(long long fileSize, int blockSize) {
+	long long blocks = (fileSize + blockSize - 1) / blockSize;
+	if(blocks > maxFileBlocks(blockSize))
+		blocks = maxFileBlocks(blockSize);
+	return (blocks + pointerBlocksFor(blocks, blockSize)) * blockSize + sizeof(struct Inode) + sizeof(struct Directory);
+}
+
+//Every inode pairs with the directory slot of the same number, so both
+//tables hold one record per expected file: one per bytesPerInode of disk,
+//or per footprint of a file of the expected size. The tables and their name
+//index are capped at 1/MAX_TABLE_SHARE of the disk, and the count is rounded
+//up to whole inode blocks.
+int planInodes(struct SuperBlock* sb, struct FormatOptions* options) {
+	long long diskBytes = (long long)sb -> totalBlockCount * sb -> blockSize;
+	long long perInode = options -> bytesPerInode;
+	if(perInode <= 0)
+		perInode = fileFootprint(options -> fileSize > 0 ? options -> fileSize : DEFAULT_FILE_SIZE, sb -> blockSize);
+	long long count = diskBytes / perInode;
+	long long cap = diskBytes / MAX_TABLE_SHARE / (sizeof(struct Inode) + sizeof(struct Directory) + 4 * sizeof(struct IndexEntry));
+	if(count > cap)
+		count = cap;
+	if(count > (1 << 29)) //keeps the name index bucket count an int
+		count = 1 << 29;
+	if(count < 1)
+		count = 1;
+	int perBlock = sb -> blockSize / sizeof(struct Inode);
+	return (int)((count + perBlock - 1) / perBlock * perBlock);
+}
+
+void createFileSystemWith(struct Disk* disk, struct FormatOptions* options) {
+	struct SuperBlock* sb = (struct SuperBlock*)malloc(sizeof(struct SuperBlock));
+	sb -> magicNumber = VALID_MAGIC_NUMBER;
+	sb -> blockSize = disk -> blockSize;
+	sb -> totalBlockCount = (int)(((off_t)disk -> totalSize * (off_t)pow(2, 20)) / disk -> blockSize);
+	sb -> compress = options -> compress;
+	sb -> dedup = options -> dedup;
+
+	sb -> version = FORMAT_VERSION;
+	sb -> inodeSize = sizeof(struct Inode);
+	sb -> mountSize = sizeof(struct Mount);
+	sb -> directorySize = sizeof(struct Directory);
+
+	int inodePerBlock = disk -> blockSize / sizeof(struct Inode);
+	int mountPerBlock = disk -> blockSize / sizeof(struct Mount);
+	int directoryPerBlock = disk -> blockSize / sizeof(struct Directory);
+
+	sb -> inodeCount = planInodes(sb, options);
+	sb -> directoryCount = sb -> inodeCount;
+	sb -> space.freeInodes = sb -> inodeCount;
+	//The mount table is rounded up to whole blocks and capped like the others.
+	long long mounts = options -> maxMounts > 0 ? options -> maxMounts : DEFAULT_MAX_MOUNTS;
+	long long blockCountMountLimit = sb -> totalBlockCount / MAX_TABLE_SHARE > 1 ? sb -> totalBlockCount / MAX_TABLE_SHARE : 1;
+	int blockCountMount = (int)((mounts + mountPerBlock - 1) / mountPerBlock);
+	if(blockCountMount > blockCountMountLimit)
+		blockCountMount = blockCountMountLimit;
+	sb -> mountCount = blockCountMount * mountPerBlock;
+	sb -> space.freeMounts = sb -> mountCount;
+
+	int blockCountSuperBlock = 1;
+	int blockCountInode = sb -> inodeCount / inodePerBlock;
+	int blockCountDirectory = (sb -> directoryCount + directoryPerBlock - 1) / directoryPerBlock; //the count is only rounded to whole inode blocks
+
+	int blockCountInodeBitmap = bitmapBlocks(sb -> inodeCount, disk -> blockSize);
+	int blockCountMountBitmap = bitmapBlocks(sb -> mountCount, disk -> blockSize);
+	int blockCountDirectoryBitmap = bitmapBlocks(sb -> directoryCount, disk -> blockSize);
+
+	sb -> indexBuckets = 1;
+	while(sb -> indexBuckets < 2 * sb -> directoryCount)
+		sb -> indexBuckets *= 2;
+	int indexPerBlock = disk -> blockSize / sizeof(struct IndexEntry);
+	int blockCountIndex = (sb -> indexBuckets + indexPerBlock - 1) / indexPerBlock;
+
+	//Only image disks can survive a crash, so only they get a journal.
+	sb -> journalBlocks = 0;
+	if(disk -> fd >= 0)
+		sb -> journalBlocks = min(JOURNAL_MAX_BLOCKS, sb -> totalBlockCount / 32);
+	if(sb -> journalBlocks < JOURNAL_MIN_BLOCKS)
+		sb -> journalBlocks = 0;
+
+	//Whatever is left holds the data bitmap and the data blocks it describes.
+	int blockCountRest = sb -> totalBlockCount - blockCountSuperBlock - blockCountInodeBitmap - blockCountMountBitmap
+		- blockCountDirectoryBitmap - blockCountInode - blockCountMount - blockCountDirectory - blockCountIndex - sb -> journalBlocks;
+
+	//Deduplication needs a reference count for every data block and a
+	//fingerprint index with a bucket for every one or two of them. Both are
+	//sized from blockCountRest, which is a little more than the data blocks.
+	int blockCountRefcount = 0, blockCountFingerprint = 0;
+	sb -> fingerprintBuckets = 0;
+	if(sb -> dedup) {
+		blockCountRefcount = ((long long)blockCountRest * sizeof(unsigned int) + disk -> blockSize - 1) / disk -> blockSize;
+		sb -> fingerprintBuckets = 1;
+		while(sb -> fingerprintBuckets * 2 <= blockCountRest)
+			sb -> fingerprintBuckets *= 2;
+		int fingerprintPerBlock = disk -> blockSize / sizeof(struct Fingerprint);
+		blockCountFingerprint = (sb -> fingerprintBuckets + fingerprintPerBlock - 1) / fingerprintPerBlock;
+		blockCountRest -= blockCountRefcount + blockCountFingerprint;
+	}
+	int blockCountDataBitmap = (blockCountRest + disk -> blockSize * 8) / (disk -> blockSize * 8 + 1);
+	sb -> dataCount = blockCountRest - blockCountDataBitmap;
+	sb -> space.freeData = sb -> dataCount;
+	sb -> space.inodeHint = sb -> space.mountHint = sb -> space.dataHint = 0;
+
+	sb -> inodeBitmap = blockCountSuperBlock;
+	sb -> mountBitmap = sb -> inodeBitmap + blockCountInodeBitmap;
+	sb -> directoryBitmap = sb -> mountBitmap + blockCountMountBitmap;
+	sb -> dataBitmap = sb -> directoryBitmap + blockCountDirectoryBitmap;
+	sb -> inode = sb -> dataBitmap + blockCountDataBitmap;
+	sb -> mount = sb -> inode + blockCountInode;
+	sb -> directory = sb -> mount + blockCountMount;
+	sb -> directoryIndex = sb -> directory + blockCountDirectory;
+	sb -> refcount = sb -> directoryIndex + blockCountIndex;
+	sb -> fingerprint = sb -> refcount + blockCountRefcount;
+	sb -> journal = sb -> fingerprint + blockCountFingerprint;
+	sb -> data = sb -> journal + sb -> journalBlocks;
+
+	unsigned char* block = borrowBlock(disk, 0, BLOCK_WRITE);
+	fillWithZero(block, disk -> blockSize);
+	memcpy(block, sb, sizeof(struct SuperBlock));
+	returnBlock(disk, 0);
+
+	zeroBlocks(disk, sb -> inodeBitmap, sb -> inode - sb -> inodeBitmap);
+	zeroBlocks(disk, sb -> directoryIndex, sb -> data - sb -> directoryIndex);
+	if(sb -> journalBlocks > 0) {
+		struct JournalHeader* header = (struct JournalHeader*)borrowBlock(disk, sb -> journal, BLOCK_WRITE);
+		header -> magic = JOURNAL_HEADER_MAGIC;
+		header -> sequence = 1;
+		returnBlock(disk, sb -> journal);
+	}
+	if(disk -> fd >= 0) {
+		disk -> cache = createCache(disk -> fd, disk -> blockSize, sb -> data, CACHE_FRAMES);
+		journalOpen(disk, sb);
+	}
+	free(sb);
+}
+
+//The regions of an image must follow each other in the order mkfs lays
+//them out and be large enough for their tables, so that no slot or bucket
+//number read from the superblock can point outside the image.
+int layoutValid(struct SuperBlock* sb) {
+	long long bits = (long long)sb -> blockSize * 8, bs = sb -> blockSize;
+	int regions[] = {1, sb -> inodeBitmap, sb -> mountBitmap, sb -> directoryBitmap, sb -> dataBitmap, sb -> inode,
+		sb -> mount, sb -> directory, sb -> directoryIndex, sb -> refcount, sb -> fingerprint, sb -> journal};
+	int i;
+	for(i = 1; i < (int)(sizeof(regions) / sizeof(int)); i += 1) {
+		if(regions[i] < regions[i - 1])
+			return 0;
+	}
+	if(sb -> inodeCount < 0 || sb -> mountCount < 0 || sb -> dataCount < 0 || sb -> directoryCount != sb -> inodeCount
+		|| sb -> journalBlocks < 0 || sb -> journalBlocks > JOURNAL_MAX_BLOCKS
+		|| (long long)sb -> journal + sb -> journalBlocks != sb -> data
+		|| (long long)sb -> data + sb -> dataCount > sb -> totalBlockCount)
+		return 0;
+	if((sb -> mountBitmap - sb -> inodeBitmap) * bits < sb -> inodeCount
+		|| (sb -> directoryBitmap - sb -> mountBitmap) * bits < sb -> mountCount
+		|| (sb -> dataBitmap - sb -> directoryBitmap) * bits < sb -> directoryCount
+		|| (sb -> inode - sb -> dataBitmap) * bits < sb -> dataCount)
+		return 0;
+	if((sb -> mount - sb -> inode) * (bs / sizeof(struct Inode)) < (unsigned long long)sb -> inodeCount
+		|| (sb -> directory - sb -> mount) * (bs / sizeof(struct Mount)) < (unsigned long long)sb -> mountCount
+		|| (sb -> directoryIndex - sb -> directory) * (bs / sizeof(struct Directory)) < (unsigned long long)sb -> directoryCount)
+		return 0;
+	//Both hash tables are masked with their bucket count.
+	if(sb -> indexBuckets <= 0 || (sb -> indexBuckets & (sb -> indexBuckets - 1)) != 0
+		|| (sb -> refcount - sb -> directoryIndex) * (bs / sizeof(struct IndexEntry)) < (unsigned long long)sb -> indexBuckets)
+		return 0;
+	if(sb -> dedup && (sb -> fingerprintBuckets <= 0 || (sb -> fingerprintBuckets & (sb -> fingerprintBuckets - 1)) != 0
+		|| (sb -> fingerprint - sb -> refcount) * (bs / sizeof(unsigned int)) < (unsigned long long)sb -> dataCount
+		|| (sb -> journal - sb -> fingerprint) * (bs / sizeof(struct Fingerprint)) < (unsigned long long)sb -> fingerprintBuckets))
+		return 0;
+	return 1;
+}
+
+//Validates an attached image and adopts the block size it was created with.
+//Nothing past the superblock is read until its block size and layout are
+//known to be ones mkfs could have made.
+int loadFileSystem(struct Disk* disk) {
+	struct SuperBlock sb;
+	memcpy(&sb, disk -> buffer, sizeof(struct SuperBlock));
+	if(sb.magicNumber != VALID_MAGIC_NUMBER || sb.blockSize < MIN_BLOCK_SIZE || sb.blockSize > MAX_BLOCK_SIZE
+		|| (sb.blockSize & (sb.blockSize - 1)) != 0)
+		return -1; //Not a file system image
+	if(sb.version != FORMAT_VERSION || sb.inodeSize != sizeof(struct Inode) || sb.mountSize != sizeof(struct Mount)
+		|| sb.directorySize != sizeof(struct Directory))
+		return -3; //Made by another version
+	if(sb.totalBlockCount <= 0 || !layoutValid(&sb))
+		return -1;
+	if((off_t)sb.totalBlockCount * sb.blockSize > (off_t)disk -> totalSize * (off_t)pow(2, 20))
+		return -2; //Image truncated
+	setBlockSize(disk, sb.blockSize);
+	if(journalReplay(disk, &sb) < 0)
+		return -4; //Journal cannot be replayed
+	disk -> cache = createCache(disk -> fd, disk -> blockSize, sb.data, CACHE_FRAMES);
+	if(journalOpen(disk, &sb) < 0)
+		return -4;
+	return 1;
+}
+
+void getSuperBlock(struct Disk* disk, struct SuperBlock* sb) {
+	memcpy(sb, borrowBlock(disk, 0, BLOCK_READ), offsetof(struct SuperBlock, space));
+	returnBlock(disk, 0);
+	memset(&sb -> space, 0, sizeof(struct SpaceCounters));
+}
+
+//The counters are logged with the bitmaps they describe, since a commit
+//only runs between operations.
+struct SpaceCounters* borrowSpace(struct Disk* disk, int mode) {
+	return &((struct SuperBlock*)borrowBlock(disk, 0, mode)) -> space;
+}
+
+void returnSpace(struct Disk* disk) {
+	returnBlock(disk, 0);
+}
+
+//Records never straddle blocks, so a record is borrowed by borrowing its block.
+//Both functions are always inlined: recordSize is a sizeof at every call,
+//so in the BLOCK_SHIFTS cases the records per block are a constant too.
+#define RECORD_CASE(shift) case shift: \
+	recordPerBlock = (1 << shift) / recordSize; \
+	return borrowBlock(disk, base + index / recordPerBlock, mode) + index % recordPerBlock * recordSize;
+
+inline void* borrowRecord(struct Disk* disk, int base, int index, int recordSize, int mode) {
+	int recordPerBlock;
+	switch(disk -> blockShift) {
+	BLOCK_SHIFTS(RECORD_CASE)
+	}
+	recordPerBlock = disk -> blockSize / recordSize;
+	return borrowBlock(disk, base + index / recordPerBlock, mode) + index % recordPerBlock * recordSize;
+}
+
+#define RETURN_RECORD_CASE(shift) case shift: \
+	returnBlock(disk, base + index / ((1 << shift) / recordSize)); \
+	return;
+
+inline void returnRecord(struct Disk* disk, int base, int index, int recordSize) {
+	switch(disk -> blockShift) {
+	BLOCK_SHIFTS(RETURN_RECORD_CASE)
+	}
+	returnBlock(disk, base + index / (disk -> blockSize / recordSize));
+}
+
+void getInode(struct Disk* disk, int base, int inumber, struct Inode* i1) {
+	memcpy(i1, borrowRecord(disk, base, inumber, sizeof(struct Inode), BLOCK_READ), sizeof(struct Inode));
+	returnRecord(disk, base, inumber, sizeof(struct Inode));
+}
+
+void setInode(struct Disk* disk, int base, int inumber, struct Inode* i1) {
+	memcpy(borrowRecord(disk, base, inumber, sizeof(struct Inode), BLOCK_WRITE), i1, sizeof(struct Inode));
+	returnRecord(disk, base, inumber, sizeof(struct Inode));
+}
+
+void getMount(struct Disk* disk, int base, int inumber, struct Mount* i1) {
+	memcpy(i1, borrowRecord(disk, base, inumber, sizeof(struct Mount), BLOCK_READ), sizeof(struct Mount));
+	returnRecord(disk, base, inumber, sizeof(struct Mount));
+}
+
+void setMount(struct Disk* disk, int base, int inumber, struct Mount* i1) {
+	memcpy(borrowRecord(disk, base, inumber, sizeof(struct Mount), BLOCK_WRITE), i1, sizeof(struct Mount));
+	returnRecord(disk, base, inumber, sizeof(struct Mount));
+}
+
+void getDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1) {
+	memcpy(i1, borrowRecord(disk, base, inumber, sizeof(struct Directory), BLOCK_READ), sizeof(struct Directory));
+	returnRecord(disk, base, inumber, sizeof(struct Directory));
+}
+
+void setDirectory(struct Disk* disk, int base, int inumber, struct Directory* i1) {
+	memcpy(borrowRecord(disk, base, inumber, sizeof(struct Directory), BLOCK_WRITE), i1, sizeof(struct Directory));
+	returnRecord(disk, base, inumber, sizeof(struct Directory));
+}
+
+//Bitmaps hold one bit per entry and may span several blocks starting at
+//block start. They are scanned a 64-bit word at a time.
+int bitmapTest(struct Disk* disk, int start, int index) {
+	int bitsPerBlock = disk -> blockSize * 8;
+	uint64_t* words = (uint64_t*)borrowBlock(disk, start + index / bitsPerBlock, BLOCK_READ);
+	int bit = (__atomic_load_n(&words[(index % bitsPerBlock) / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+	returnBlock(disk, start + index / bitsPerBlock);
+	return bit;
+}
+
+//Bitmap words are only changed with atomic operations, so allocations from
+//several threads never need a lock. Clearing a bit releases whatever was
+//written to the block and claiming one acquires it.
+void bitmapSet(struct Disk* disk, int start, int index, int value) {
+	int bitsPerBlock = disk -> blockSize * 8;
+	uint64_t* words = (uint64_t*)borrowBlock(disk, start + index / bitsPerBlock, BLOCK_WRITE);
+	if(value)
+		__atomic_fetch_or(&words[(index % bitsPerBlock) / 64], (uint64_t)1 << (index % 64), __ATOMIC_ACQUIRE);
+	else
+		__atomic_fetch_and(&words[(index % bitsPerBlock) / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELEASE);
+	returnBlock(disk, start + index / bitsPerBlock);
+}
+
+//First index >= from whose bit equals value, or -1.
+int bitmapNext(struct Disk* disk, int start, int count, int from, int value) {
+	int wordsPerBlock = disk -> blockSize / 8;
+	int w = from / 64, lastWord = (count + 63) / 64;
+	while(w < lastWord) {
+		int blockNo = start + w / wordsPerBlock;
+		int blockEnd = min(lastWord, (w / wordsPerBlock + 1) * wordsPerBlock);
+		uint64_t* words = (uint64_t*)borrowBlock(disk, blockNo, BLOCK_READ);
+		for(; w < blockEnd; w += 1) {
+			uint64_t word = __atomic_load_n(&words[w % wordsPerBlock], __ATOMIC_RELAXED);
+			uint64_t bits = value ? word : ~word;
+			if(w == from / 64)
+				bits &= ~(uint64_t)0 << (from % 64);
+			if(bits != 0) {
+				int index = w * 64 + __builtin_ctzll(bits);
+				returnBlock(disk, blockNo);
+				return index < count ? index : -1;
+			}
+		}
+		returnBlock(disk, blockNo);
+	}
+	return -1;
+}
+
+//Counts clear bits, stopping early once enough have been seen.
+int bitmapCountFree(struct Disk* disk, int start, int count, int enough) {
+	int wordsPerBlock = disk -> blockSize / 8;
+	int w = 0, lastWord = (count + 63) / 64, free = 0;
+	while(w < lastWord && free < enough) {
+		int blockNo = start + w / wordsPerBlock;
+		int blockEnd = min(lastWord, (w / wordsPerBlock + 1) * wordsPerBlock);
+		uint64_t* words = (uint64_t*)borrowBlock(disk, blockNo, BLOCK_READ);
+		for(; w < blockEnd; w += 1) {
+			uint64_t bits = ~__atomic_load_n(&words[w % wordsPerBlock], __ATOMIC_RELAXED);
+			if(w == lastWord - 1 && count % 64 != 0)
+				bits &= ((uint64_t)1 << (count % 64)) - 1;
+			free += __builtin_popcountll(bits);
+		}
+		returnBlock(disk, blockNo);
+	}
+	return free;
+}
+
+//Allocates the first run of clear bits at or after goal (wrapping around),
+//at most want long. Whole free words are claimed 64 bits at a time. Bits
+//are claimed atomically; when another thread takes the first one the
+//search starts over from there.
+int bitmapAllocExtent(struct Disk* disk, int start, int count, int goal, int want, int* length) {
+	int bitsPerBlock = disk -> blockSize * 8, first = -1;
+	*length = 0;
+	statAdd(&disk -> stats.allocations, 1);
+	while(*length == 0) {
+		first = bitmapNext(disk, start, count, goal, 0);
+		if(first == -1 && goal > 0) {
+			statAdd(&disk -> stats.allocWords, (count + 63) / 64 - goal / 64);
+			goal = 0;
+			first = bitmapNext(disk, start, count, 0, 0);
+		}
+		statAdd(&disk -> stats.allocWords, first == -1 ? (count + 63) / 64 - goal / 64 : first / 64 - goal / 64 + 1);
+		if(first == -1)
+			return -1; //Bitmap full
+		int index = first;
+		while(*length < want && index < count) {
+			int blockNo = start + index / bitsPerBlock;
+			uint64_t* words = (uint64_t*)borrowBlock(disk, blockNo, BLOCK_WRITE);
+			int blockEnd = min(count, (index / bitsPerBlock + 1) * bitsPerBlock);
+			while(*length < want && index < blockEnd) {
+				uint64_t* word = &words[(index % bitsPerBlock) / 64], empty = 0;
+				if(index % 64 == 0 && want - *length >= 64 && index + 64 <= blockEnd
+					&& __atomic_compare_exchange_n(word, &empty, ~(uint64_t)0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					index += 64;
+					*length += 64;
+					continue;
+				}
+				uint64_t bit = (uint64_t)1 << (index % 64);
+				if(__atomic_fetch_or(word, bit, __ATOMIC_ACQUIRE) & bit)
+					break;
+				index += 1;
+				*length += 1;
+			}
+			returnBlock(disk, blockNo);
+			if(index < blockEnd)
+				break;
+		}
+		goal = first;
+	}
+	return first;
+}
+
+//Claims every bit of [first, first + n) or, when one is taken, none.
+int bitmapClaimRange(struct Disk* disk, int start, int first, int n) {
+	int bitsPerBlock = disk -> blockSize * 8, i;
+	for(i = 0; i < n; i += 1) {
+		int index = first + i;
+		uint64_t* words = (uint64_t*)borrowBlock(disk, start + index / bitsPerBlock, BLOCK_WRITE);
+		uint64_t bit = (uint64_t)1 << (index % 64);
+		uint64_t old = __atomic_fetch_or(&words[(index % bitsPerBlock) / 64], bit, __ATOMIC_ACQUIRE);
+		returnBlock(disk, start + index / bitsPerBlock);
+		if(old & bit)
+			break;
+	}
+	if(i == n)
+		return 1;
+	while(i > 0) {
+		i -= 1;
+		bitmapSet(disk, start, first + i, 0);
+	}
+	return 0;
+}
+
+//Claims one slot of a table that has a free counter. A full table fails
+//before its bitmap is read. The search starts at the hint, which moves past
+//the slot unless a free below it came in meanwhile.
+int allocSlot(struct Disk* disk, int start, int count, int* free, int* hint) {
+	int length, left = __atomic_load_n(free, __ATOMIC_RELAXED);
+	do {
+		if(left <= 0)
+			return -1; //Table full
+	} while(!__atomic_compare_exchange_n(free, &left, left - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	int from = __atomic_load_n(hint, __ATOMIC_RELAXED);
+	int slot = bitmapAllocExtent(disk, start, count, from, 1, &length);
+	if(slot == -1) {
+		__atomic_add_fetch(free, 1, __ATOMIC_RELAXED);
+		return -1; //Table full
+	}
+	if(slot >= from)
+		__atomic_compare_exchange_n(hint, &from, slot + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return slot;
+}
+
+void freeSlot(struct Disk* disk, int start, int slot, int* free, int* hint) {
+	bitmapSet(disk, start, slot, 0);
+	__atomic_add_fetch(free, 1, __ATOMIC_RELAXED);
+	int from = __atomic_load_n(hint, __ATOMIC_RELAXED);
+	while(slot < from && !__atomic_compare_exchange_n(hint, &from, slot, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int freeDataCount(struct Disk* disk) {
+	int free = __atomic_load_n(&borrowSpace(disk, BLOCK_READ) -> freeData, __ATOMIC_RELAXED);
+	returnSpace(disk);
+	return free;
+}
+
+//bitmapAllocExtent on the data bitmap that keeps the free count in step.
+//Without a goal the search starts at the hint.
+int allocData(struct Disk* disk, struct SuperBlock* sb, int goal, int want, int* length) {
+	struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+	int first = -1, from = goal > 0 ? goal : __atomic_load_n(&space -> dataHint, __ATOMIC_RELAXED);
+	*length = 0;
+	if(__atomic_load_n(&space -> freeData, __ATOMIC_RELAXED) > 0)
+		first = bitmapAllocExtent(disk, sb -> dataBitmap, sb -> dataCount, from, want, length);
+	if(first != -1) {
+		__atomic_sub_fetch(&space -> freeData, *length, __ATOMIC_RELAXED);
+		if(goal <= 0 && first >= from)
+			__atomic_compare_exchange_n(&space -> dataHint, &from, first + *length, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	returnSpace(disk);
+	return first;
+}
+
+//Gives back blocks that were allocated but never used.
+void unclaimData(struct Disk* disk, struct SuperBlock* sb, int first, int n) {
+	if(n <= 0)
+		return;
+	struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+	int i;
+	for(i = 0; i < n; i += 1)
+		freeSlot(disk, sb -> dataBitmap, first + i, &space -> freeData, &space -> dataHint);
+	returnSpace(disk);
+}
+
+//Frees a data block and gives back the chunk around it once the whole
+//chunk is free. On journaled disks that waits for the commit that makes
+//the free durable, or a crash could leave files pointing at holes.
+void freeDataBlock(struct Disk* disk, struct SuperBlock* sb, int block) {
+	unclaimData(disk, sb, block, 1);
+	if(disk -> journal == NULL) {
+		discardFreeChunks(disk, sb, block, block);
+		return;
+	}
+	int low = __atomic_load_n(&disk -> freedLow, __ATOMIC_RELAXED);
+	while((low == -1 || block < low) && !__atomic_compare_exchange_n(&disk -> freedLow, &low, block, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	int high = __atomic_load_n(&disk -> freedHigh, __ATOMIC_RELAXED);
+	while(block > high && !__atomic_compare_exchange_n(&disk -> freedHigh, &high, block, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//Discards every chunk overlapping data blocks low..high whose blocks are
+//all free. The chunk is claimed while its memory goes, so an allocation
+//racing with the discard can never have its data dropped.
+void discardFreeChunks(struct Disk* disk, struct SuperBlock* sb, int low, int high) {
+	off_t chunk = DISCARD_CHUNK;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if(chunk < pageSize)
+		chunk = pageSize;
+	if(chunk < disk -> blockSize)
+		chunk = disk -> blockSize;
+	int perChunk = chunk / disk -> blockSize;
+	off_t offset = (off_t)(sb -> data + low) * disk -> blockSize / chunk * chunk;
+	for(; offset <= (off_t)(sb -> data + high) * disk -> blockSize; offset += chunk) {
+		int first = offset / disk -> blockSize - sb -> data;
+		if(first < 0 || first + perChunk > sb -> dataCount)
+			continue; //Shares pages with metadata or runs past the disk
+		int used = bitmapNext(disk, sb -> dataBitmap, sb -> dataCount, first, 1);
+		if(used != -1 && used < first + perChunk)
+			continue;
+		if(bitmapClaimRange(disk, sb -> dataBitmap, first, perChunk) == 0)
+			continue;
+		discardBytes(disk, offset, chunk);
+		int i;
+		for(i = 0; i < perChunk; i += 1)
+			bitmapSet(disk, sb -> dataBitmap, first + i, 0);
+	}
+}
+
+//Files map their first POINTERS_PER_INODE blocks directly. Later blocks go
+//through a single, double and then triple indirect tree of pointer blocks.
+//Pointers are data block indices, NULL_BLOCK marks a hole.
+long long maxFileBlocks(int blockSize) {
+	long long perBlock = blockSize / sizeof(int), span = 1, total = POINTERS_PER_INODE;
+	int level;
+	for(level = 0; level < INDIRECT_LEVELS; level += 1) {
+		span *= perBlock;
+		total += span;
+	}
+	return total;
+}
+
+//Pointer blocks needed to map the first blocks blocks of a file.
+long long pointerBlocksFor(long long blocks, int blockSize) {
+	long long perBlock = blockSize / sizeof(int), span = 1, total = 0;
+	int level;
+	blocks -= POINTERS_PER_INODE;
+	for(level = 0; level < INDIRECT_LEVELS && blocks > 0; level += 1) {
+		span *= perBlock;
+		long long covered = blocks < span ? blocks : span, below = span;
+		while(below > 1) {
+			below /= perBlock;
+			total += (covered + below - 1) / below;
+		}
+		blocks -= span;
+	}
+	return total;
+}
+
+int allocPointerBlock(struct Disk* disk, struct SuperBlock* sb, int goal) {
+	int length, block = allocData(disk, sb, goal, 1, &length);
+	if(block == -1)
+		return NULL_BLOCK;
+	memset(borrowBlock(disk, sb -> data + block, BLOCK_WRITE), 0xff, disk -> blockSize);
+	returnBlock(disk, sb -> data + block);
+	return block;
+}
+
+struct MapEntry* mapCacheSlot(struct Disk* disk, int inumber, long long group) {
+	return &disk -> mapCache[(inumber * 31 + group) & (MAP_CACHE_SIZE - 1)];
+}
+
+void mapCacheForget(struct Disk* disk, int inumber) {
+	int i;
+	for(i = 0; i < MAP_CACHE_SIZE; i += 1) {
+		pthread_mutex_lock(entryLock(disk, i));
+		if(disk -> mapCache[i].inumber == inumber)
+			disk -> mapCache[i].inumber = -1;
+		pthread_mutex_unlock(entryLock(disk, i));
+	}
+}
+
+//Walks down to the pointer block that holds run group of the file's
+//indirect pointers, creating missing pointer blocks when alloc is set.
+int bmapLeaf(struct Disk* disk, struct SuperBlock* sb, struct Inode* i1, long long group, int alloc) {
+	long long perBlock = disk -> blockSize / sizeof(int), index = group, span = 1;
+	int level;
+	for(level = 0; level < INDIRECT_LEVELS && index >= span; level += 1) {
+		index -= span;
+		span *= perBlock;
+	}
+	if(level == INDIRECT_LEVELS)
+		return NULL_BLOCK; //Beyond the largest file
+	if(i1 -> indirect[level] == NULL_BLOCK && alloc)
+		i1 -> indirect[level] = allocPointerBlock(disk, sb, 0);
+	int block = i1 -> indirect[level];
+	for(span /= perBlock; span >= 1 && block != NULL_BLOCK; span /= perBlock) {
+		int* pointers = (int*)borrowBlock(disk, sb -> data + block, alloc ? BLOCK_WRITE : BLOCK_READ);
+		int* next = &pointers[index / span];
+		if(*next == NULL_BLOCK && alloc)
+			*next = allocPointerBlock(disk, sb, block + 1);
+		returnBlock(disk, sb -> data + block);
+		block = *next;
+		index %= span;
+	}
+	return block;
+}
+
+//Maps block fileBlock of the file to its data block. With newBlock set the
+//mapping is installed first, CLEAR_BLOCK removes it. Leaf lookups are cached per disk, so
+//sequential access touches the inode tree once per run of pointers.
+int bmap(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long fileBlock, int newBlock) {
+	if(fileBlock < POINTERS_PER_INODE) {
+		if(newBlock != NULL_BLOCK)
+			i1 -> blockNumbers[fileBlock] = newBlock == CLEAR_BLOCK ? NULL_BLOCK : newBlock;
+		return i1 -> blockNumbers[fileBlock];
+	}
+	int perBlock = disk -> blockSize / sizeof(int);
+	long long group = (fileBlock - POINTERS_PER_INODE) / perBlock;
+	struct MapEntry* entry = mapCacheSlot(disk, inumber, group);
+	pthread_mutex_t* lock = entryLock(disk, entry - disk -> mapCache);
+	pthread_mutex_lock(lock);
+	int leaf = entry -> inumber == inumber && entry -> group == group ? entry -> leaf : NULL_BLOCK;
+	pthread_mutex_unlock(lock);
+	if(leaf == NULL_BLOCK) {
+		leaf = bmapLeaf(disk, sb, i1, group, newBlock != NULL_BLOCK && newBlock != CLEAR_BLOCK);
+		if(leaf == NULL_BLOCK)
+			return NULL_BLOCK;
+		pthread_mutex_lock(lock);
+		entry -> inumber = inumber;
+		entry -> group = group;
+		entry -> leaf = leaf;
+		pthread_mutex_unlock(lock);
+	}
+	int* pointers = (int*)borrowBlock(disk, sb -> data + leaf, newBlock != NULL_BLOCK ? BLOCK_WRITE : BLOCK_READ);
+	int slot = (fileBlock - POINTERS_PER_INODE) % perBlock;
+	if(newBlock != NULL_BLOCK)
+		pointers[slot] = newBlock == CLEAR_BLOCK ? NULL_BLOCK : newBlock;
+	int block = pointers[slot];
+	returnBlock(disk, sb -> data + leaf);
+	return block;
+}
+
+//Frees a pointer block and everything below it.
+void freePointerTree(struct Disk* disk, struct SuperBlock* sb, int block, int depth) {
+	int i, perBlock = disk -> blockSize / sizeof(int);
+	int* pointers = (int*)borrowBlock(disk, sb -> data + block, BLOCK_READ);
+	for(i = 0; i < perBlock; i += 1) {
+		if(pointers[i] < 0)
+			continue; //Hole or compressed chunk mark
+		if(depth > 0)
+			freePointerTree(disk, sb, pointers[i], depth - 1);
+		else
+			releaseBlock(disk, sb, pointers[i]);
+	}
+	returnBlock(disk, sb -> data + block);
+	freeDataBlock(disk, sb, block);
+}
+
+//Frees the blocks mapped by the pointer tree at block for file blocks keep
+//and beyond; base is the first file block the tree maps. Returns 1 when
+//nothing below block is left and block itself has been freed.
+int trimPointerTree(struct Disk* disk, struct SuperBlock* sb, int block, int depth, long long base, long long keep) {
+	long long perBlock = disk -> blockSize / sizeof(int), span = 1;
+	int i, level, used = 0;
+	if(base >= keep) {
+		freePointerTree(disk, sb, block, depth);
+		return 1;
+	}
+	for(level = 0; level < depth; level += 1)
+		span *= perBlock;
+	int* pointers = (int*)borrowBlock(disk, sb -> data + block, BLOCK_WRITE);
+	for(i = 0; i < perBlock; i += 1) {
+		if(pointers[i] == NULL_BLOCK)
+			continue;
+		if(base + (i + 1) * span <= keep)
+			used = 1;
+		else if(depth > 0 && trimPointerTree(disk, sb, pointers[i], depth - 1, base + i * span, keep) == 0)
+			used = 1;
+		else {
+			if(depth == 0 && pointers[i] >= 0)
+				releaseBlock(disk, sb, pointers[i]);
+			pointers[i] = NULL_BLOCK;
+		}
+	}
+	returnBlock(disk, sb -> data + block);
+	if(used == 0)
+		freeDataBlock(disk, sb, block);
+	return !used;
+}
+
+//The directory index is an on-disk open addressing hash table from
+//(parent directory, file name) to directory slot, kept at most half full.
+//Each bucket caches the key's hash so that a probe only reads a directory
+//record on a likely hit.
+unsigned int nameHash(int parent, unsigned char* name) {
+	unsigned int hash = 2166136261u;
+	int i;
+	for(i = 0; i < 4; i += 1) {
+		hash ^= (parent >> (8 * i)) & 0xff;
+		hash *= 16777619u;
+	}
+	while(*name != 0) {
+		hash ^= *name;
+		hash *= 16777619u;
+		name += 1;
+	}
+	return hash;
+}
+
+struct IndexEntry* borrowIndexEntry(struct Disk* disk, struct SuperBlock* sb, int bucket, int mode) {
+	return borrowRecord(disk, sb -> directoryIndex, bucket, sizeof(struct IndexEntry), mode);
+}
+
+void returnIndexEntry(struct Disk* disk, struct SuperBlock* sb, int bucket) {
+	returnRecord(disk, sb -> directoryIndex, bucket, sizeof(struct IndexEntry));
+}
+
+//Bucket holding name, or the empty bucket where it would go when *slot is -1.
+int indexProbe(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name, int* slot) {
+	unsigned int hash = nameHash(parent, name);
+	int mask = sb -> indexBuckets - 1, bucket = hash & mask;
+	*slot = -1;
+	while(1) {
+		struct IndexEntry* e = borrowIndexEntry(disk, sb, bucket, BLOCK_READ);
+		int candidate = e -> slot - 1, match = 0;
+		if(candidate >= 0 && e -> hash == hash) {
+			struct Directory* d1 = borrowRecord(disk, sb -> directory, candidate, sizeof(struct Directory), BLOCK_READ);
+			match = d1 -> parent == parent && strcmp((char*)d1 -> fileName, (char*)name) == 0;
+			returnRecord(disk, sb -> directory, candidate, sizeof(struct Directory));
+		}
+		returnIndexEntry(disk, sb, bucket);
+		if(candidate < 0)
+			return bucket;
+		if(match) {
+			*slot = candidate;
+			return bucket;
+		}
+		bucket = (bucket + 1) & mask;
+	}
+}
+
+//Directory slot of name, or -1.
+int indexLookup(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name) {
+	int slot;
+	indexProbe(disk, sb, parent, name, &slot);
+	return slot;
+}
+
+void indexInsert(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name, int slot) {
+	int existing, bucket = indexProbe(disk, sb, parent, name, &existing);
+	struct IndexEntry* e = borrowIndexEntry(disk, sb, bucket, BLOCK_WRITE);
+	e -> hash = nameHash(parent, name);
+	e -> slot = slot + 1;
+	returnIndexEntry(disk, sb, bucket);
+}
+
+//Backward shift deletion: later entries of the probe run move up into the
+//hole, so lookups never need tombstones.
+void indexRemove(struct Disk* disk, struct SuperBlock* sb, int parent, unsigned char* name) {
+	int slot, hole = indexProbe(disk, sb, parent, name, &slot);
+	if(slot == -1)
+		return;
+	int mask = sb -> indexBuckets - 1, next = hole;
+	while(1) {
+		next = (next + 1) & mask;
+		struct IndexEntry* e = borrowIndexEntry(disk, sb, next, BLOCK_READ);
+		struct IndexEntry moved = *e;
+		returnIndexEntry(disk, sb, next);
+		if(moved.slot == 0)
+			break;
+		int home = moved.hash & mask;
+		if(hole <= next ? (hole < home && home <= next) : (hole < home || home <= next))
+			continue;
+		*borrowIndexEntry(disk, sb, hole, BLOCK_WRITE) = moved;
+		returnIndexEntry(disk, sb, hole);
+		hole = next;
+	}
+	struct IndexEntry* e = borrowIndexEntry(disk, sb, hole, BLOCK_WRITE);
+	e -> hash = 0;
+	e -> slot = 0;
+	returnIndexEntry(disk, sb, hole);
+}
+
+//Eight 32-bit lanes of xxHash32 style rounds, mixed into 64 bits at the
+//end. The lanes are a GCC vector type, so each round is a handful of SIMD
+//instructions on whatever the target has. len is a multiple of 32.
+uint64_t blockHash(unsigned char* data, int len) {
+	HashLanes acc = {1, 2, 3, 4, 5, 6, 7, 8}, lane;
+	int i;
+	acc *= 2654435761u;
+	for(i = 0; i < len; i += sizeof(HashLanes)) {
+		memcpy(&lane, data + i, sizeof(lane));
+		acc += lane * 2246822519u;
+		acc = (acc << 13) | (acc >> 19);
+		acc *= 2654435761u;
+	}
+	uint64_t hash = len;
+	for(i = 0; i < 8; i += 1) {
+		hash = (hash ^ acc[i]) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+//The fingerprint index maps the hash of a data block's contents to the
+//block, like the directory index but with probe runs cut at
+//FINGERPRINT_MAX_PROBE, so a lookup never scans far. A hash match is
+//confirmed by comparing the blocks. Callers hold dedupLock.
+struct Fingerprint* borrowFingerprint(struct Disk* disk, struct SuperBlock* sb, int bucket, int mode) {
+	return borrowRecord(disk, sb -> fingerprint, bucket, sizeof(struct Fingerprint), mode);
+}
+
+void returnFingerprint(struct Disk* disk, struct SuperBlock* sb, int bucket) {
+	returnRecord(disk, sb -> fingerprint, bucket, sizeof(struct Fingerprint));
+}
+
+unsigned int* borrowRefcount(struct Disk* disk, struct SuperBlock* sb, int block, int mode) {
+	return borrowRecord(disk, sb -> refcount, block, sizeof(unsigned int), mode);
+}
+
+void returnRefcount(struct Disk* disk, struct SuperBlock* sb, int block) {
+	returnRecord(disk, sb -> refcount, block, sizeof(unsigned int));
+}
+
+//Bucket of the block holding content, or the empty bucket where it would
+//go when *found is -1; -1 when there is no room within the probe limit.
+int fingerprintProbe(struct Disk* disk, struct SuperBlock* sb, uint64_t hash, unsigned char* content, int* found) {
+	int step, mask = sb -> fingerprintBuckets - 1, bucket = hash & mask;
+	*found = -1;
+	for(step = 0; step < FINGERPRINT_MAX_PROBE; step += 1, bucket = (bucket + 1) & mask) {
+		struct Fingerprint* f = borrowFingerprint(disk, sb, bucket, BLOCK_READ);
+		int candidate = f -> block - 1, match = 0;
+		if(candidate >= 0 && f -> hash == hash) {
+			match = memcmp(borrowBlock(disk, sb -> data + candidate, BLOCK_READ), content, disk -> blockSize) == 0;
+			returnBlock(disk, sb -> data + candidate);
+		}
+		returnFingerprint(disk, sb, bucket);
+		if(candidate < 0)
+			return bucket;
+		if(match) {
+			*found = candidate;
+			return bucket;
+		}
+	}
+	return -1;
+}
+
+//Backward shift deletion, as in indexRemove.
+void fingerprintRemove(struct Disk* disk, struct SuperBlock* sb, uint64_t hash, int block) {
+	int step, mask = sb -> fingerprintBuckets - 1, hole = hash & mask, next;
+	for(step = 0; step < FINGERPRINT_MAX_PROBE; step += 1, hole = (hole + 1) & mask) {
+		struct Fingerprint* f = borrowFingerprint(disk, sb, hole, BLOCK_READ);
+		int candidate = f -> block - 1;
+		returnFingerprint(disk, sb, hole);
+		if(candidate == block)
+			break;
+		if(candidate < 0)
+			return;
+	}
+	if(step == FINGERPRINT_MAX_PROBE)
+		return;
+	next = hole;
+	while(1) {
+		next = (next + 1) & mask;
+		struct Fingerprint* f = borrowFingerprint(disk, sb, next, BLOCK_READ);
+		struct Fingerprint moved = *f;
+		returnFingerprint(disk, sb, next);
+		if(moved.block == 0)
+			break;
+		int home = moved.hash & mask;
+		if(hole <= next ? (hole < home && home <= next) : (hole < home || home <= next))
+			continue;
+		*borrowFingerprint(disk, sb, hole, BLOCK_WRITE) = moved;
+		returnFingerprint(disk, sb, hole);
+		hole = next;
+	}
+	struct Fingerprint* f = borrowFingerprint(disk, sb, hole, BLOCK_WRITE);
+	f -> hash = 0;
+	f -> block = 0;
+	returnFingerprint(disk, sb, hole);
+}
+
+//A data block's refcount counts the references beyond the first, so
+//blocks that are not shared keep 0 and never need it updated.
+//Returns a block that already holds content, with a reference taken for
+//the caller, or -1. own is the block the caller maps there now; finding
+//it takes no reference.
+int dedupFind(struct Disk* disk, struct SuperBlock* sb, unsigned char* content, int own) {
+	uint64_t hash = blockHash(content, disk -> blockSize);
+	int found;
+	pthread_mutex_lock(&disk -> dedupLock);
+	fingerprintProbe(disk, sb, hash, content, &found);
+	if(found != -1 && found != own) {
+		*borrowRefcount(disk, sb, found, BLOCK_WRITE) += 1;
+		returnRefcount(disk, sb, found);
+		statAdd(&disk -> stats.sharedBlocks, 1);
+	}
+	pthread_mutex_unlock(&disk -> dedupLock);
+	return found;
+}
+
+//Adds block, which now holds content, to the index unless a block with
+//the same contents got there first.
+void dedupIndex(struct Disk* disk, struct SuperBlock* sb, unsigned char* content, int block) {
+	uint64_t hash = blockHash(content, disk -> blockSize);
+	int found;
+	pthread_mutex_lock(&disk -> dedupLock);
+	int bucket = fingerprintProbe(disk, sb, hash, content, &found);
+	if(bucket != -1 && found == -1) {
+		struct Fingerprint* f = borrowFingerprint(disk, sb, bucket, BLOCK_WRITE);
+		f -> hash = hash;
+		f -> block = block + 1;
+		returnFingerprint(disk, sb, bucket);
+		*borrowRefcount(disk, sb, block, BLOCK_WRITE) |= REF_INDEXED;
+		returnRefcount(disk, sb, block);
+	}
+	pthread_mutex_unlock(&disk -> dedupLock);
+}
+
+//Makes the data block at fileBlock safe to change in place. A shared
+//block is copied to a new one, which is mapped and returned, or
+//NULL_BLOCK when the disk is full; an indexed one leaves the index.
+int writableBlock(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long fileBlock, int block) {
+	int length, copy = block;
+	pthread_mutex_lock(&disk -> dedupLock);
+	unsigned int* ref = borrowRefcount(disk, sb, block, BLOCK_WRITE);
+	if((*ref & ~REF_INDEXED) == 0) {
+		if(*ref & REF_INDEXED) {
+			fingerprintRemove(disk, sb, blockHash(borrowBlock(disk, sb -> data + block, BLOCK_READ), disk -> blockSize), block);
+			returnBlock(disk, sb -> data + block);
+			*ref = 0;
+		}
+	}
+	else if((copy = allocData(disk, sb, block + 1, 1, &length)) != -1)
+		*ref -= 1;
+	returnRefcount(disk, sb, block);
+	pthread_mutex_unlock(&disk -> dedupLock);
+	if(copy == -1)
+		return NULL_BLOCK;
+	if(copy != block) {
+		memcpy(borrowBlock(disk, sb -> data + copy, BLOCK_WRITE), borrowBlock(disk, sb -> data + block, BLOCK_READ), disk -> blockSize);
+		returnBlock(disk, sb -> data + block);
+		returnBlock(disk, sb -> data + copy);
+		bmap(disk, sb, inumber, i1, fileBlock, copy);
+	}
+	return copy;
+}
+
+//Drops one reference to a data block and frees it with the last one.
+void releaseBlock(struct Disk* disk, struct SuperBlock* sb, int block) {
+	if(sb -> dedup == 0) {
+		freeDataBlock(disk, sb, block);
+		return;
+	}
+	pthread_mutex_lock(&disk -> dedupLock);
+	unsigned int* ref = borrowRefcount(disk, sb, block, BLOCK_WRITE);
+	if((*ref & ~REF_INDEXED) > 0)
+		*ref -= 1;
+	else {
+		if(*ref & REF_INDEXED) {
+			fingerprintRemove(disk, sb, blockHash(borrowBlock(disk, sb -> data + block, BLOCK_READ), disk -> blockSize), block);
+			returnBlock(disk, sb -> data + block);
+		}
+		*ref = 0;
+		freeDataBlock(disk, sb, block);
+	}
+	returnRefcount(disk, sb, block);
+	pthread_mutex_unlock(&disk -> dedupLock);
+}
+
+//The dentry cache remembers recent (parent, name) lookups of a disk in a
+//direct mapped table, so a warm path resolves without touching the index,
+//the directory table or the inode table. Only hits are cached and removing
+//a name forgets it.
+struct Dentry* dentrySlot(struct Disk* disk, int parent, unsigned char* name) {
+	return &disk -> dentries[nameHash(parent, name) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+//Inumber of name inside directory parent, or -1.
+int dentryLookup(struct Disk* disk, int parent, unsigned char* name, int* isDirectory) {
+	if(strlen((char*)name) >= STRING_SIZE)
+		return -1;
+	struct Dentry* e = dentrySlot(disk, parent, name);
+	pthread_mutex_t* lock = entryLock(disk, e - disk -> dentries);
+	int inumber = -1;
+	pthread_mutex_lock(lock);
+	if(e -> inumber != -1 && e -> parent == parent && strcmp((char*)e -> name, (char*)name) == 0) {
+		*isDirectory = e -> isDirectory;
+		inumber = e -> inumber;
+	}
+	pthread_mutex_unlock(lock);
+	if(inumber != -1)
+		return inumber;
+
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_rdlock(&disk -> namespaceLock);
+	int slot = indexLookup(disk, &sb, parent, name);
+	if(slot != -1) {
+		struct Directory* d1 = borrowRecord(disk, sb.directory, slot, sizeof(struct Directory), BLOCK_READ);
+		inumber = d1 -> inumber;
+		returnRecord(disk, sb.directory, slot, sizeof(struct Directory));
+		struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+		*isDirectory = i1 -> isDirectory;
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		pthread_mutex_lock(lock);
+		e -> parent = parent;
+		e -> inumber = inumber;
+		e -> isDirectory = *isDirectory;
+		strcpy((char*)e -> name, (char*)name);
+		pthread_mutex_unlock(lock);
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	return inumber;
+}
+void dentryForget(struct Disk* disk, int parent, unsigned char* name) {
+	struct Dentry* e = dentrySlot(disk, parent, name);
+	pthread_mutex_lock(entryLock(disk, e - disk -> dentries));
+	if(e -> parent == parent && strcmp((char*)e -> name, (char*)name) == 0)
+		e -> inumber = -1;
+	pthread_mutex_unlock(entryLock(disk, e - disk -> dentries));
+}
+
+//A disk has few mounts and every absolute path starts with one, so the
+//mount table is copied into memory and reloaded only after it changes.
+//Callers hold mountLock.
+void loadMountNames(struct Disk* disk) {
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	free(disk -> mountNames);
+	disk -> mountNames = NULL;
+	int i, count = 0;
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount* m1 = borrowRecord(disk, sb.mount, i, sizeof(struct Mount), BLOCK_READ);
+		if(m1 -> magicNumber == VALID_MAGIC_NUMBER) {
+			disk -> mountNames = (struct MountName*)realloc(disk -> mountNames, (count + 1) * sizeof(struct MountName));
+			strcpy((char*)disk -> mountNames[count].diskName, (char*)m1 -> diskName);
+			disk -> mountNames[count].location = m1 -> location;
+			count += 1;
+		}
+		returnRecord(disk, sb.mount, i, sizeof(struct Mount));
+	}
+	disk -> mountNameCount = count;
+}
+
+struct Disk* mountLookup(struct Disk* disk, unsigned char* name) {
+	struct Disk* location = NULL;
+	int i;
+	pthread_mutex_lock(&disk -> mountLock);
+	if(disk -> mountNameCount == -1)
+		loadMountNames(disk);
+	for(i = 0; i < disk -> mountNameCount && location == NULL; i += 1) {
+		if(strcmp((char*)disk -> mountNames[i].diskName, (char*)name) == 0)
+			location = disk -> mountNames[i].location;
+	}
+	pthread_mutex_unlock(&disk -> mountLock);
+	return location;
+}
+
+//Copies the name diskMount is mounted under into name, or returns NULL.
+unsigned char* mountNameOf(struct Disk* disk, struct Disk* diskMount, unsigned char* name) {
+	unsigned char* result = NULL;
+	int i;
+	pthread_mutex_lock(&disk -> mountLock);
+	if(disk -> mountNameCount == -1)
+		loadMountNames(disk);
+	for(i = 0; i < disk -> mountNameCount && result == NULL; i += 1) {
+		if(disk -> mountNames[i].location == diskMount)
+			result = (unsigned char*)strcpy((char*)name, (char*)disk -> mountNames[i].diskName);
+	}
+	pthread_mutex_unlock(&disk -> mountLock);
+	return result;
+}
+
+void mountCacheForget(struct Disk* disk) {
+	pthread_mutex_lock(&disk -> mountLock);
+	disk -> mountNameCount = -1;
+	pthread_mutex_unlock(&disk -> mountLock);
+}
+
+//A path starting with \ or with a mount name is absolute, anything else is
+//relative to cwd. Every component but the last must be a directory.
+int resolvePath(char* buffer1, struct Path* path, struct Disk* rootDisk, struct Path* cwd) {
+	size_t k, length = strlen(buffer1), mark = arenaMark();
+	char* buffer = (char*)arenaAlloc(length + 1);
+	memcpy(buffer, buffer1, length + 1);
+
+	int i, isDirectory = 1, valid = 1;
+	for(k = 0; k < length; k += 1) {
+		if(buffer[k] == '\\')
+			buffer[k] = ' ';
+	}
+	char* args[PATH_SIZE / 2 + 1];
+	if(splitLine(buffer, args, PATH_SIZE / 2) < 0)
+		valid = 0; //Too many components
+	struct Disk* currDisk = rootDisk;
+	int currInumber = -1;
+	if(buffer1[0] != '\\' && cwd != NULL && (args[0] == NULL || mountLookup(rootDisk, (unsigned char*)args[0]) == NULL)) {
+		currDisk = cwd -> location;
+		currInumber = cwd -> inumber;
+	}
+
+	for(i = 0; args[i] != NULL && valid == 1; i += 1) {
+		struct Disk* mounted = NULL;
+		statAdd(&currDisk -> stats.pathSteps, 1);
+		if(isDirectory == 0)
+			valid = 0; //Files have no entries
+		else if(strcmp(args[i], ".") == 0)
+			continue;
+		else if(strcmp(args[i], "..") == 0) {
+			if(currInumber != -1) {
+				struct SuperBlock sb;
+				getSuperBlock(currDisk, &sb);
+				struct Directory d1;
+				pthread_rwlock_rdlock(&currDisk -> namespaceLock);
+				getDirectory(currDisk, sb.directory, currInumber, &d1);
+				pthread_rwlock_unlock(&currDisk -> namespaceLock);
+				currInumber = d1.parent;
+			}
+			else
+				currDisk = rootDisk;
+		}
+		else if(currInumber == -1 && (mounted = mountLookup(currDisk, (unsigned char*)args[i])) != NULL)
+			currDisk = mounted;
+		else {
+			currInumber = dentryLookup(currDisk, currInumber, (unsigned char*)args[i], &isDirectory);
+			if(currInumber == -1)
+				valid = 0;
+		}
+	}
+	arenaReset(mark);
+	if(valid == 0) {
+		path -> location = NULL;
+		path -> inumber = -1;
+		return -1; //Path is invalid
+	}
+	path -> location = currDisk;
+	path -> inumber = currInumber;
+	return 1;
+}
+
+void pathResolution(char* buffer, struct Path* path, struct Disk* rootDisk, struct Path* cwd) {
+	if(resolvePath(buffer, path, rootDisk, cwd) < 0)
+		printf("Path is invalid\n");
+}
+
+//Splits a path into the directory that will hold it and the final name.
+void partition(char* buffer1, struct PseudoPath* path, struct Disk* rootDisk, struct Path* cwd) {
+	size_t mark = arenaMark();
+	char* buffer = (char*)arenaAlloc(strlen(buffer1) + 1);
+	strcpy(buffer, buffer1);
+	int i;
+	struct Path p1;
+	for(i = strlen(buffer) - 1; i >= 0 && buffer[i] != '\\'; i -= 1);
+	if(i >= 0) {
+		buffer[i] = 0;
+		pathResolution(i == 0 ? "\\" : buffer, &p1, rootDisk, cwd);
+	}
+	else
+		p1 = *cwd;
+	path -> location = p1.location;
+	path -> parent = p1.inumber;
+	snprintf((char*)path -> fileName, PATH_SIZE, "%s", buffer + i + 1);
+	arenaReset(mark);
+	if(p1.location != NULL && isDirectoryInode(p1.location, p1.inumber) == 0) {
+		printf("Not a directory\n");
+		path -> location = NULL;
+	}
+}
+
+void printDirectory(struct Disk* disk, struct SuperBlock* sb, int inumber) {
+	if(inumber == -1)
+		return;
+	struct Directory d1;
+	getDirectory(disk, sb -> directory, inumber, &d1);
+	printDirectory(disk, sb, d1.parent);
+	printf("\\%s", d1.fileName);
+}
+
+//Prints path the way the shell accepts it, e.g. C:\dir\sub.
+void printPath(struct Disk* rootDisk, struct Path* path) {
+	struct SuperBlock sb;
+	getSuperBlock(path -> location, &sb);
+	unsigned char name[STRING_SIZE];
+	if(path -> location != rootDisk && mountNameOf(rootDisk, path -> location, name) != NULL)
+		printf("%s", name);
+	if(path -> inumber == -1)
+		printf("\\");
+	pthread_rwlock_rdlock(&path -> location -> namespaceLock);
+	printDirectory(path -> location, &sb, path -> inumber);
+	pthread_rwlock_unlock(&path -> location -> namespaceLock);
+}
+
+//Disk roots are directories too.
+int isDirectoryInode(struct Disk* disk, int inumber) {
+	if(inumber == -1)
+		return 1;
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+	int result = i1 -> isDirectory;
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	return result;
+}
+
+//A name is one path component: not empty, not . or .., and free of the
+//separator, since no path could reach an entry whose name holds one.
+int validName(unsigned char* name) {
+	size_t length = strlen((char*)name);
+	return length > 0 && length < STRING_SIZE && strchr((char*)name, '\\') == NULL
+		&& strcmp((char*)name, ".") != 0 && strcmp((char*)name, "..") != 0;
+}
+
+//Files and directories share the inode and directory tables. A directory
+//owns no blocks and keeps its number of entries in sizeofFile.
+int createNode(struct Disk* disk, int parent, unsigned char* name, int isDirectory) {
+	struct SuperBlock sb;
+	struct Inode i1;
+	struct Directory d1;
+
+	if(!validName(name))
+		return -3; //Invalid name
+	uint64_t started = nowNanos();
+	getSuperBlock(disk, &sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int i = -1, result = 1;
+	if(indexLookup(disk, &sb, parent, name) != -1)
+		result = -2; //Duplicate name
+	else {
+		struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+		i = allocSlot(disk, sb.directoryBitmap, sb.inodeCount, &space -> freeInodes, &space -> inodeHint);
+		returnSpace(disk);
+	}
+	if(result == 1 && i == -1)
+		result = -1; //Space not available
+	else if(result == 1) {
+		bitmapSet(disk, sb.inodeBitmap, i, 1);
+		memset(&i1, 0, sizeof(struct Inode));
+		memset(&d1, 0, sizeof(struct Directory));
+		i1.isDirectory = isDirectory;
+		i1.compressed = isDirectory == 0 && sb.compress;
+		memset(i1.blockNumbers, 0xff, sizeof(i1.blockNumbers));
+		memset(i1.indirect, 0xff, sizeof(i1.indirect));
+		setInode(disk, sb.inode, i, &i1);
+		strcpy((char*)d1.fileName, (char*)name);
+		d1.inumber = i;
+		d1.parent = parent;
+		setDirectory(disk, sb.directory, i, &d1);
+		indexInsert(disk, &sb, parent, name, i);
+		if(parent != -1) {
+			struct Inode* dir = borrowRecord(disk, sb.inode, parent, sizeof(struct Inode), BLOCK_WRITE);
+			dir -> sizeofFile += 1;
+			returnRecord(disk, sb.inode, parent, sizeof(struct Inode));
+		}
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	journalEnd(disk);
+	recordLatency(OP_CREATE, started);
+	return result;
+}
+
+int createFile(struct Disk* disk, int parent, unsigned char* name) {
+	return createNode(disk, parent, name, 0);
+}
+
+int makeDirectory(struct Disk* disk, int parent, unsigned char* name) {
+	return createNode(disk, parent, name, 1);
+}
+
+//Frees every data and pointer block reachable from the inode; holes are
+//skipped. Callers hold the inode lock.
+void releaseFile(struct Disk* disk, int inumber) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_WRITE);
+	i1 -> sizeofFile = 0;
+	i1 -> storedSize = 0;
+	int i;
+	for(i = 0; i < POINTERS_PER_INODE; i += 1) {
+		if(i1 -> blockNumbers[i] >= 0)
+			releaseBlock(disk, &sb, i1 -> blockNumbers[i]);
+		i1 -> blockNumbers[i] = NULL_BLOCK;
+	}
+	for(i = 0; i < INDIRECT_LEVELS; i += 1) {
+		if(i1 -> indirect[i] != NULL_BLOCK)
+			freePointerTree(disk, &sb, i1 -> indirect[i], i);
+		i1 -> indirect[i] = NULL_BLOCK;
+	}
+	mapCacheForget(disk, inumber);
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+}
+
+//Drops inumber from its directory and frees its inode and directory slot.
+//Callers hold namespaceLock for writing.
+void unlinkNode(struct Disk* disk, struct SuperBlock* sb, int inumber) {
+	struct Directory* d1 = borrowRecord(disk, sb -> directory, inumber, sizeof(struct Directory), BLOCK_READ);
+	int parent = d1 -> parent;
+	indexRemove(disk, sb, parent, d1 -> fileName);
+	dentryForget(disk, parent, d1 -> fileName);
+	returnRecord(disk, sb -> directory, inumber, sizeof(struct Directory));
+	if(parent != -1) {
+		struct Inode* dir = borrowRecord(disk, sb -> inode, parent, sizeof(struct Inode), BLOCK_WRITE);
+		dir -> sizeofFile -= 1;
+		returnRecord(disk, sb -> inode, parent, sizeof(struct Inode));
+	}
+	bitmapSet(disk, sb -> inodeBitmap, inumber, 0);
+	struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+	freeSlot(disk, sb -> directoryBitmap, inumber, &space -> freeInodes, &space -> inodeHint);
+	returnSpace(disk);
+}
+
+int removeFile(struct Disk* disk, int inumber) {
+	struct SuperBlock sb;
+
+	if(isDirectoryInode(disk, inumber))
+		return -1; //Is a directory
+	uint64_t started = nowNanos();
+	getSuperBlock(disk, &sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	releaseFile(disk, inumber);
+	unlinkNode(disk, &sb, inumber);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	journalEnd(disk);
+	recordLatency(OP_REMOVE, started);
+	return 1;
+}
+
+int removeDirectory(struct Disk* disk, int inumber) {
+	struct SuperBlock sb;
+
+	if(inumber == -1 || isDirectoryInode(disk, inumber) == 0)
+		return -2; //Not a directory
+	uint64_t started = nowNanos();
+	getSuperBlock(disk, &sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int result = 1;
+	if(sizeOfFile(disk, inumber) != 0)
+		result = -1; //Directory not empty
+	else
+		unlinkNode(disk, &sb, inumber);
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	journalEnd(disk);
+	recordLatency(OP_REMOVE, started);
+	return result;
+}
+
+//Moves inumber to name inside directory parent on the same disk by
+//rewriting its directory record and index entry; no data block is touched.
+//A NULL name keeps the current one. An existing file of that name is
+//replaced.
+int renameFile(struct Disk* disk, int inumber, int parent, unsigned char* name) {
+	struct SuperBlock sb;
+	struct Directory d1;
+	unsigned char newName[STRING_SIZE];
+	int ancestor, existing, result = 1;
+
+	getSuperBlock(disk, &sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	getDirectory(disk, sb.directory, inumber, &d1);
+	if(name != NULL && !validName(name))
+		result = -3; //Invalid name
+	else
+		strcpy((char*)newName, (char*)(name == NULL ? d1.fileName : name));
+	for(ancestor = parent; ancestor != -1 && result == 1; ancestor = d1.parent) {
+		if(ancestor == inumber)
+			result = -1; //Directory moved below itself
+		getDirectory(disk, sb.directory, ancestor, &d1);
+	}
+	existing = result == 1 ? indexLookup(disk, &sb, parent, newName) : -1;
+	if(existing == inumber)
+		result = 0; //Already there
+	else if(existing != -1 && (isDirectoryInode(disk, existing) || isDirectoryInode(disk, inumber)))
+		result = -2; //Duplicate name
+	if(result == 1 && existing != -1) {
+		pthread_rwlock_wrlock(inodeLock(disk, existing));
+		releaseFile(disk, existing);
+		unlinkNode(disk, &sb, existing);
+		pthread_rwlock_unlock(inodeLock(disk, existing));
+	}
+	if(result == 1) {
+		getDirectory(disk, sb.directory, inumber, &d1);
+		indexRemove(disk, &sb, d1.parent, d1.fileName);
+		dentryForget(disk, d1.parent, d1.fileName);
+		if(parent != d1.parent) {
+			struct Inode* dir;
+			if(d1.parent != -1) {
+				dir = borrowRecord(disk, sb.inode, d1.parent, sizeof(struct Inode), BLOCK_WRITE);
+				dir -> sizeofFile -= 1;
+				returnRecord(disk, sb.inode, d1.parent, sizeof(struct Inode));
+			}
+			if(parent != -1) {
+				dir = borrowRecord(disk, sb.inode, parent, sizeof(struct Inode), BLOCK_WRITE);
+				dir -> sizeofFile += 1;
+				returnRecord(disk, sb.inode, parent, sizeof(struct Inode));
+			}
+		}
+		d1.parent = parent;
+		strcpy((char*)d1.fileName, (char*)newName);
+		setDirectory(disk, sb.directory, inumber, &d1);
+		indexInsert(disk, &sb, parent, d1.fileName, inumber);
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	journalEnd(disk);
+	return result < 0 ? result : 1;
+}
+
+//Writes len bytes at offset, or at the end of the file when offset is -1,
+//and touches only the blocks in that range. Holes in the range are filled
+//from as few contiguous extents as the bitmap allows, starting right after
+//the block before the range. A new block that is only partly written is
+//zero filled first, so bytes past the end of a file always read back as
+//zero. If the disk fills up partway the write stops with -2 and keeps the
+//blocks it finished: the size only grows to the end of the last of them,
+//and only their bytes are counted as written. Callers hold the inode lock
+//for writing.
+int writeRange(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_WRITE);
+	if(offset == -1)
+		offset = i1 -> sizeofFile;
+	if(i1 -> compressed) {
+		int result = writeChunks(disk, &sb, inumber, i1, offset, buffer, len);
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		return result;
+	}
+	long long i, first = offset / disk -> blockSize, last = (offset + len - 1) / disk -> blockSize;
+	if(last >= maxFileBlocks(disk -> blockSize)) {
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		return -1; //Size exceeded
+	}
+	//Blocks past the end of the file are never mapped, so only the part of
+	//the range inside the file has to be looked up.
+	long long endBlock = (i1 -> sizeofFile + disk -> blockSize - 1) / disk -> blockSize, holes = 0;
+	for(i = first; i <= last; i += 1) {
+		if(i >= endBlock || bmap(disk, &sb, inumber, i1, i, NULL_BLOCK) == NULL_BLOCK)
+			holes += 1;
+	}
+	long long needed = holes == 0 ? 0 : holes + pointerBlocksFor(last + 1, disk -> blockSize) - pointerBlocksFor(first, disk -> blockSize) + INDIRECT_LEVELS;
+	if(needed > 0 && freeDataCount(disk) < needed) {
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		return -2; // Blocks not available
+	}
+	int block, extent = 0, length = 0, goal = 0, result = 1;
+	long long end = i1 -> sizeofFile, written = 0, finalEnd = offset + len > end ? offset + len : end;
+	size_t mark = arenaMark();
+	unsigned char* scratch = sb.dedup ? (unsigned char*)arenaAlloc(disk -> blockSize) : NULL;
+	if(first > 0 && first - 1 < endBlock && (block = bmap(disk, &sb, inumber, i1, first - 1, NULL_BLOCK)) != NULL_BLOCK)
+		goal = block + 1;
+	for(i = first; i <= last && result == 1; i += 1) {
+		long long blockStart = i * disk -> blockSize;
+		int from = offset > blockStart ? offset - blockStart : 0;
+		int to = offset + len < blockStart + disk -> blockSize ? offset + len - blockStart : disk -> blockSize;
+		int fresh = 0, low = from, high = to;
+		unsigned char* source = buffer + (blockStart + from - offset);
+		block = i < endBlock ? bmap(disk, &sb, inumber, i1, i, NULL_BLOCK) : NULL_BLOCK;
+		//On a dedup disk every block that ends up whole is looked up by its
+		//contents first. A partial last block is left out, since appends
+		//keep changing it.
+		int whole = sb.dedup && blockStart + disk -> blockSize <= finalEnd;
+		if(whole) {
+			if(from > 0 || to < disk -> blockSize) {
+				if(block != NULL_BLOCK) {
+					memcpy(scratch, borrowBlock(disk, sb.data + block, BLOCK_READ), disk -> blockSize);
+					returnBlock(disk, sb.data + block);
+				}
+				else
+					memset(scratch, 0, disk -> blockSize);
+				memcpy(scratch + from, source, to - from);
+				source = scratch;
+				low = 0;
+				high = disk -> blockSize;
+			}
+			int shared = dedupFind(disk, &sb, source, block);
+			if(shared != -1 && shared != block && bmap(disk, &sb, inumber, i1, i, shared) != shared) {
+				releaseBlock(disk, &sb, shared);
+				result = -2; // Blocks not available
+				break;
+			}
+			if(shared != -1) {
+				if(block != NULL_BLOCK && shared != block)
+					releaseBlock(disk, &sb, block);
+				if(block == NULL_BLOCK)
+					holes -= 1;
+				written += to - from;
+				if(blockStart + to > end)
+					end = blockStart + to;
+				continue;
+			}
+		}
+		if(block != NULL_BLOCK && sb.dedup && (block = writableBlock(disk, &sb, inumber, i1, i, block)) == NULL_BLOCK) {
+			result = -2; // Blocks not available
+			break;
+		}
+		if(block == NULL_BLOCK) {
+			//Other threads allocate too, so the free count above may no
+			//longer hold; the write then stops at what fit.
+			if(length == 0)
+				extent = allocData(disk, &sb, goal, holes, &length);
+			if(extent == -1 || bmap(disk, &sb, inumber, i1, i, extent) != extent) {
+				if(extent != -1)
+					unclaimData(disk, &sb, extent, 1);
+				result = -2; // Blocks not available
+				break;
+			}
+			block = extent;
+			extent += 1;
+			length -= 1;
+			holes -= 1;
+			goal = extent;
+			fresh = 1;
+		}
+		unsigned char* data = borrowBlock(disk, sb.data + block, BLOCK_WRITE);
+		if(fresh && (low > 0 || high < disk -> blockSize))
+			memset(data, 0, disk -> blockSize);
+		memcpy(data + low, source, high - low);
+		returnBlock(disk, sb.data + block);
+		if(whole)
+			dedupIndex(disk, &sb, source, block);
+		written += to - from;
+		if(blockStart + to > end)
+			end = blockStart + to;
+	}
+	unclaimData(disk, &sb, extent, length);
+	arenaReset(mark);
+	statAdd(&disk -> stats.bytesWritten, written);
+	i1 -> sizeofFile = end;
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	return result;
+}
+
+int writeFileAt(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len) {
+	if(isDirectoryInode(disk, inumber))
+		return -3; //Is a directory
+	if(offset < 0 || len < 0)
+		return -1; //Invalid range
+	if(len == 0)
+		return 1;
+	uint64_t started = nowNanos();
+	journalBegin(disk);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	int result = writeRange(disk, inumber, offset, buffer, len);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	journalEnd(disk);
+	recordLatency(OP_WRITE, started);
+	return result;
+}
+
+//The end of the file is read under the inode lock, so concurrent appends
+//never overwrite each other.
+int appendFile(struct Disk* disk, int inumber, unsigned char* buffer, int len) {
+	if(isDirectoryInode(disk, inumber))
+		return -3; //Is a directory
+	if(len <= 0)
+		return len == 0 ? 1 : -1;
+	uint64_t started = nowNanos();
+	journalBegin(disk);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	int result = writeRange(disk, inumber, -1, buffer, len);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	journalEnd(disk);
+	recordLatency(OP_WRITE, started);
+	return result;
+}
+//Shrinking frees every block past the new end and clears the tail of the
+//last block; growing leaves a hole that reads back as zero.
+int truncateFile(struct Disk* disk, int inumber, long long size) {
+	if(isDirectoryInode(disk, inumber))
+		return -3; //Is a directory
+	if(size < 0 || (size + disk -> blockSize - 1) / disk -> blockSize > maxFileBlocks(disk -> blockSize))
+		return -1; //Size exceeded
+	journalBegin(disk);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	int result = truncateRange(disk, inumber, size);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	journalEnd(disk);
+	return result;
+}
+
+//A compressed file is cut at a chunk boundary, after its last chunk has
+//been stored again without the bytes past size. That takes new blocks, so
+//it can fail with -2 and leave the file as it was. Callers hold the inode
+//lock for writing.
+int truncateRange(struct Disk* disk, int inumber, long long size) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_WRITE);
+	if(size < i1 -> sizeofFile) {
+		long long keep = (size + disk -> blockSize - 1) / disk -> blockSize;
+		long long base = POINTERS_PER_INODE, span = disk -> blockSize / sizeof(int);
+		int i, tail = size % disk -> blockSize, block;
+		if(i1 -> compressed) {
+			int k = chunkBlocks(disk -> blockSize), chunkSize = k * disk -> blockSize, result = 1;
+			long long chunk = (size + chunkSize - 1) / chunkSize;
+			if(size % chunkSize != 0) {
+				size_t mark = arenaMark();
+				unsigned char* data = (unsigned char*)arenaAlloc(2 * chunkSize);
+				if(loadChunk(disk, &sb, inumber, i1, size / chunkSize, data, data + chunkSize) < 0)
+					memset(data, 0, chunkSize); //Damaged, so nothing worth keeping
+				result = storeChunk(disk, &sb, inumber, i1, size / chunkSize, data, size % chunkSize, data + chunkSize);
+				arenaReset(mark);
+			}
+			if(result < 0) {
+				returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+				return result;
+			}
+			for(keep = chunk * k; keep < (i1 -> sizeofFile + chunkSize - 1) / chunkSize * k; keep += 1) {
+				if(bmap(disk, &sb, inumber, i1, keep, NULL_BLOCK) >= 0)
+					i1 -> storedSize -= disk -> blockSize;
+			}
+			keep = chunk * k;
+		}
+		else if(tail != 0 && (block = bmap(disk, &sb, inumber, i1, keep - 1, NULL_BLOCK)) != NULL_BLOCK) {
+			if(sb.dedup && (block = writableBlock(disk, &sb, inumber, i1, keep - 1, block)) == NULL_BLOCK) {
+				returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+				return -2; //Space not available
+			}
+			memset(borrowBlock(disk, sb.data + block, BLOCK_WRITE) + tail, 0, disk -> blockSize - tail);
+			returnBlock(disk, sb.data + block);
+		}
+		for(i = keep < POINTERS_PER_INODE ? keep : POINTERS_PER_INODE; i < POINTERS_PER_INODE; i += 1) {
+			if(i1 -> blockNumbers[i] >= 0)
+				releaseBlock(disk, &sb, i1 -> blockNumbers[i]);
+			i1 -> blockNumbers[i] = NULL_BLOCK;
+		}
+		for(i = 0; i < INDIRECT_LEVELS; i += 1) {
+			if(i1 -> indirect[i] != NULL_BLOCK && trimPointerTree(disk, &sb, i1 -> indirect[i], i, base, keep))
+				i1 -> indirect[i] = NULL_BLOCK;
+			base += span;
+			span *= disk -> blockSize / sizeof(int);
+		}
+		mapCacheForget(disk, inumber);
+	}
+	i1 -> sizeofFile = size;
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	return 1;
+}
+
+//Truncating and writing happen under one inode lock and one journal
+//operation, so no reader sees the file empty. Contents that cannot fit
+//are refused before the old ones are dropped; only another writer taking
+//the room in between can still leave the file short.
+int writeFile(struct Disk* disk, int inumber, unsigned char* buffer, int len) {
+	if(isDirectoryInode(disk, inumber))
+		return -3; //Is a directory
+	if(len < 0)
+		return -1; //Invalid range
+	uint64_t started = nowNanos();
+	journalBegin(disk);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	int result = rewriteFits(disk, inumber, len) ? 1 : -2; //Space not available
+	if(result == 1) {
+		truncateRange(disk, inumber, 0);
+		result = len == 0 ? 1 : writeRange(disk, inumber, 0, buffer, len);
+	}
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	journalEnd(disk);
+	recordLatency(OP_WRITE, started);
+	return result;
+}
+
+//Copies up to len bytes from offset into buffer and returns how many were
+//copied; nothing past the end of the file. Directories read as empty.
+int readFileAt(struct Disk* disk, int inumber, long long offset, unsigned char* buffer, int len) {
+	struct SuperBlock sb;
+	uint64_t started = nowNanos();
+
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_rdlock(inodeLock(disk, inumber));
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+	if(i1 -> isDirectory || offset < 0 || offset >= i1 -> sizeofFile || len <= 0) {
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		pthread_rwlock_unlock(inodeLock(disk, inumber));
+		return 0;
+	}
+	if(len > i1 -> sizeofFile - offset)
+		len = i1 -> sizeofFile - offset;
+	len = readRange(disk, &sb, inumber, i1, offset, buffer, len);
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	if(len < 0)
+		return len;
+	statAdd(&disk -> stats.bytesRead, len);
+	recordLatency(OP_READ, started);
+	return len;
+}
+
+//Copies the len bytes at offset, which lie inside the file, into buffer.
+//Returns len, or -4 when a compressed chunk is damaged. Callers hold the
+//inode lock.
+int readRange(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len) {
+	readAhead(disk, sb, inumber, i1, offset, len);
+	if(i1 -> compressed)
+		return readChunks(disk, sb, inumber, i1, offset, buffer, len);
+	long long i, n, first = offset / disk -> blockSize, last = (offset + len - 1) / disk -> blockSize;
+	int block = bmap(disk, sb, inumber, i1, first, NULL_BLOCK), after = NULL_BLOCK;
+	//Blocks that follow each other on disk, or a run of holes, are copied
+	//as one piece.
+	for(i = first; i <= last; i += n, block = after) {
+		for(n = 1; i + n <= last; n += 1) {
+			after = bmap(disk, sb, inumber, i1, i + n, NULL_BLOCK);
+			if(after != (block == NULL_BLOCK ? NULL_BLOCK : block + n))
+				break;
+		}
+		long long start = offset > i * disk -> blockSize ? offset : i * disk -> blockSize;
+		long long stop = offset + len < (i + n) * disk -> blockSize ? offset + len : (i + n) * disk -> blockSize;
+		unsigned char* out = buffer + (start - offset);
+		if(block == NULL_BLOCK) {
+			memset(out, 0, stop - start);
+			continue;
+		}
+		memcpy(out, borrowExtent(disk, sb -> data + block, n, BLOCK_READ) + (start - i * disk -> blockSize), stop - start);
+		returnExtent(disk);
+	}
+	return len;
+}
+
+//Keeps a window of blocks past a sequential reader in flight. A read
+//that starts where the last one of the file ended, or at the start of the
+//file, is sequential; the window then starts at READAHEAD_MIN bytes and
+//doubles each time it is topped up, up to READAHEAD_MAX. It is topped up
+//once half of it has been read, so every reader's prefetch is large.
+//Any other read drops the window. Callers hold the inode lock.
+void readAhead(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, int len) {
+	if(disk -> fd < 0)
+		return;
+	struct ReadStream* s = &disk -> streams[inumber & (READ_STREAMS - 1)];
+	long long from = 0, to = 0, last = (offset + len - 1) / disk -> blockSize;
+	long long end = (i1 -> sizeofFile + disk -> blockSize - 1) / disk -> blockSize;
+	int least = READAHEAD_MIN / disk -> blockSize > 0 ? READAHEAD_MIN / disk -> blockSize : 1;
+	int most = READAHEAD_MAX / disk -> blockSize > least ? READAHEAD_MAX / disk -> blockSize : least;
+	pthread_mutex_lock(entryLock(disk, inumber));
+	if(s -> inumber != inumber || offset != s -> next) {
+		s -> window = offset == 0 ? least : 0;
+		s -> ahead = last + 1;
+	}
+	if(s -> window > 0) {
+		from = s -> ahead > last + 1 ? s -> ahead : last + 1;
+		to = last + 1 + s -> window < end ? last + 1 + s -> window : end;
+		if(from < to && (to - from >= s -> window / 2 || to == end)) {
+			s -> ahead = to;
+			s -> window = 2 * s -> window < most ? 2 * s -> window : most;
+		}
+		else
+			from = to = 0;
+	}
+	s -> inumber = inumber;
+	s -> next = offset + len;
+	pthread_mutex_unlock(entryLock(disk, inumber));
+	long long i, n;
+	int block = from < to ? bmap(disk, sb, inumber, i1, from, NULL_BLOCK) : NULL_BLOCK, after = NULL_BLOCK;
+	for(i = from; i < to; i += n, block = after) {
+		for(n = 1; i + n < to; n += 1) {
+			after = bmap(disk, sb, inumber, i1, i + n, NULL_BLOCK);
+			if(block < 0 || after != block + n)
+				break;
+		}
+		if(block >= 0)
+			prefetchBlocks(disk, sb -> data + block, n);
+	}
+}
+
+int chunkBlocks(int blockSize) {
+	return COMPRESS_CHUNK_SIZE / blockSize > COMPRESS_MIN_BLOCKS ? COMPRESS_CHUNK_SIZE / blockSize : COMPRESS_MIN_BLOCKS;
+}
+
+//A chunk takes the first blocks of its chunkBlocks pointers. Compressed,
+//the pointer after them holds COMPRESSED_MARK minus the compressed length
+//instead of a block; otherwise the chunk is stored as is. Trailing zeros
+//are never stored, so an all zero chunk is a hole.
+//Returns how many blocks chunk takes and sets mark to the pointer after
+//them.
+int chunkExtent(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, int* mark) {
+	int n, k = chunkBlocks(disk -> blockSize);
+	*mark = NULL_BLOCK;
+	for(n = 0; n < k; n += 1) {
+		int block = bmap(disk, sb, inumber, i1, chunk * k + n, NULL_BLOCK);
+		if(block < 0) {
+			*mark = block;
+			break;
+		}
+	}
+	return n;
+}
+
+//Reads chunk into data, which holds chunkBlocks blocks and is zero filled
+//past what is stored; scratch holds as much again. Returns the bytes read
+//from disk, or -4 when the compressed data is damaged.
+int loadChunk(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, unsigned char* data, unsigned char* scratch) {
+	int i, mark, k = chunkBlocks(disk -> blockSize), blockSize = disk -> blockSize;
+	int n = chunkExtent(disk, sb, inumber, i1, chunk, &mark);
+	unsigned char* to = mark <= COMPRESSED_MARK ? scratch : data;
+	for(i = 0; i < n; i += 1) {
+		int block = bmap(disk, sb, inumber, i1, chunk * k + i, NULL_BLOCK);
+		memcpy(to + i * blockSize, borrowBlock(disk, sb -> data + block, BLOCK_READ), blockSize);
+		returnBlock(disk, sb -> data + block);
+	}
+	if(mark > COMPRESSED_MARK) {
+		memset(data + n * blockSize, 0, (k - n) * blockSize);
+		return n * blockSize;
+	}
+	int length = COMPRESSED_MARK - mark;
+	if(length > n * blockSize)
+		return -4; //Damaged chunk
+	memset(data, 0, k * blockSize);
+	return lz4Decompress(scratch, length, data, k * blockSize) < 0 ? -4 : length;
+}
+
+//Replaces chunk with the first length bytes of data, compressed when that
+//saves a block. The new blocks are taken before the old ones are freed, so
+//when the disk is full (-2) the chunk is left as it was.
+int storeChunk(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long chunk, unsigned char* data, int length, unsigned char* scratch) {
+	int old[COMPRESS_CHUNK_SIZE / MIN_BLOCK_SIZE + COMPRESS_MIN_BLOCKS];
+	int i, j, k = chunkBlocks(disk -> blockSize), blockSize = disk -> blockSize, mark = NULL_BLOCK;
+	long long first = chunk * k;
+	unsigned char* from = data;
+	while(length > 0 && data[length - 1] == 0)
+		length -= 1;
+	int n = (length + blockSize - 1) / blockSize;
+	if(n > 1) {
+		int packed = lz4Compress(data, length, scratch, (n - 1) * blockSize);
+		if(packed > 0) {
+			from = scratch;
+			length = packed;
+			n = (packed + blockSize - 1) / blockSize;
+			mark = COMPRESSED_MARK - packed;
+		}
+	}
+	long long needed = n + pointerBlocksFor(first + k, blockSize) - pointerBlocksFor(first, blockSize) + INDIRECT_LEVELS;
+	if(n > 0 && freeDataCount(disk) < needed)
+		return -2; //Blocks not available
+	for(i = 0; i < k; i += 1)
+		old[i] = bmap(disk, sb, inumber, i1, first + i, NULL_BLOCK);
+	int extent = 0, run = 0, goal = old[0] >= 0 ? old[0] : 0;
+	for(i = 0; i < n; i += 1) {
+		if(run == 0)
+			extent = allocData(disk, sb, goal, n - i, &run);
+		if(extent == -1 || bmap(disk, sb, inumber, i1, first + i, extent) != extent) {
+			//Another thread took the blocks counted above: put the old ones back.
+			for(j = 0; j < i; j += 1) {
+				unclaimData(disk, sb, bmap(disk, sb, inumber, i1, first + j, NULL_BLOCK), 1);
+				bmap(disk, sb, inumber, i1, first + j, old[j] == NULL_BLOCK ? CLEAR_BLOCK : old[j]);
+			}
+			if(extent != -1)
+				unclaimData(disk, sb, extent, run);
+			return -2; //Blocks not available
+		}
+		unsigned char* block = borrowBlock(disk, sb -> data + extent, BLOCK_WRITE);
+		int used = length - i * blockSize < blockSize ? length - i * blockSize : blockSize;
+		memcpy(block, from + i * blockSize, used);
+		memset(block + used, 0, blockSize - used);
+		returnBlock(disk, sb -> data + extent);
+		extent += 1;
+		run -= 1;
+		goal = extent;
+	}
+	unclaimData(disk, sb, extent, run);
+	for(i = n; i < k; i += 1) {
+		int want = i == n ? mark : NULL_BLOCK;
+		if(old[i] != want)
+			bmap(disk, sb, inumber, i1, first + i, want == NULL_BLOCK ? CLEAR_BLOCK : want);
+	}
+	for(i = 0; i < k; i += 1) {
+		if(old[i] >= 0) {
+			releaseBlock(disk, sb, old[i]);
+			i1 -> storedSize -= blockSize;
+		}
+	}
+	i1 -> storedSize += (long long)n * blockSize;
+	return 1;
+}
+
+//Writes to a compressed file store every chunk they touch again; a chunk
+//that is only partly written is read back first. Like writeRange, a write
+//that runs out of space keeps the chunks already stored and no more.
+int writeChunks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len) {
+	int k = chunkBlocks(disk -> blockSize), chunkSize = k * disk -> blockSize, result = 1;
+	long long c, end = offset + len > i1 -> sizeofFile ? offset + len : i1 -> sizeofFile, written = 0;
+	if(((offset + len - 1) / chunkSize + 1) * k > maxFileBlocks(disk -> blockSize))
+		return -1; //Size exceeded
+	size_t mark = arenaMark();
+	unsigned char* data = (unsigned char*)arenaAlloc(2 * chunkSize);
+	for(c = offset / chunkSize; c <= (offset + len - 1) / chunkSize && result == 1; c += 1) {
+		long long chunkStart = c * chunkSize;
+		int from = offset > chunkStart ? offset - chunkStart : 0;
+		int to = offset + len < chunkStart + chunkSize ? offset + len - chunkStart : chunkSize;
+		int length = end - chunkStart < chunkSize ? end - chunkStart : chunkSize;
+		if((from > 0 || to < length) && (result = loadChunk(disk, sb, inumber, i1, c, data, data + chunkSize)) < 0)
+			break;
+		memcpy(data + from, buffer + (chunkStart + from - offset), to - from);
+		if((result = storeChunk(disk, sb, inumber, i1, c, data, length, data + chunkSize)) < 0)
+			break;
+		written += to - from;
+		if(chunkStart + to > i1 -> sizeofFile)
+			i1 -> sizeofFile = chunkStart + to;
+		result = 1;
+	}
+	arenaReset(mark);
+	statAdd(&disk -> stats.bytesWritten, written);
+	return result;
+}
+
+//Reads go one chunk at a time. Chunks stored as is are copied block by
+//block like an ordinary file, compressed ones are decompressed whole.
+int readChunks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1, long long offset, unsigned char* buffer, int len) {
+	int b, k = chunkBlocks(disk -> blockSize), blockSize = disk -> blockSize, chunkSize = k * blockSize;
+	unsigned char* data = NULL;
+	size_t mark = arenaMark();
+	long long c;
+	for(c = offset / chunkSize; c <= (offset + len - 1) / chunkSize; c += 1) {
+		long long chunkStart = c * chunkSize;
+		int from = offset > chunkStart ? offset - chunkStart : 0;
+		int to = offset + len < chunkStart + chunkSize ? offset + len - chunkStart : chunkSize;
+		unsigned char* out = buffer + (chunkStart + from - offset);
+		int chunkMark, n = chunkExtent(disk, sb, inumber, i1, c, &chunkMark);
+		if(chunkMark <= COMPRESSED_MARK) {
+			if(data == NULL)
+				data = (unsigned char*)arenaAlloc(2 * chunkSize);
+			if(loadChunk(disk, sb, inumber, i1, c, data, data + chunkSize) < 0) {
+				arenaReset(mark);
+				return -4; //Damaged chunk
+			}
+			memcpy(out, data + from, to - from);
+			continue;
+		}
+		for(b = from / blockSize; b * blockSize < to; b += 1) {
+			int low = from > b * blockSize ? from : b * blockSize;
+			int high = to < (b + 1) * blockSize ? to : (b + 1) * blockSize;
+			int block = b < n ? bmap(disk, sb, inumber, i1, c * k + b, NULL_BLOCK) : NULL_BLOCK;
+			if(block == NULL_BLOCK) {
+				memset(out + (low - from), 0, high - low);
+				continue;
+			}
+			memcpy(out + (low - from), borrowBlock(disk, sb -> data + block, BLOCK_READ) + (low - b * blockSize), high - low);
+			returnBlock(disk, sb -> data + block);
+		}
+	}
+	arenaReset(mark);
+	return len;
+}
+
+//Rewrites a file in the other layout. The whole file goes through memory
+//and the disk must have room for a second copy while it is rewritten.
+int compressFile(struct Disk* disk, int inumber, int on) {
+	struct SuperBlock sb;
+
+	if(isDirectoryInode(disk, inumber))
+		return -3; //Is a directory
+	getSuperBlock(disk, &sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(inodeLock(disk, inumber));
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+	long long size = i1 -> sizeofFile, blocks = (size + disk -> blockSize - 1) / disk -> blockSize;
+	long long needed = blocks + pointerBlocksFor(blocks, disk -> blockSize) + INDIRECT_LEVELS;
+	unsigned char* buffer = NULL;
+	size_t mark = arenaMark();
+	int result = 1;
+	if(i1 -> compressed == on)
+		;
+	else if(size > INT_MAX)
+		result = -1; //Size exceeded
+	else if(freeDataCount(disk) < needed)
+		result = -2; //Space not available
+	else if((buffer = (unsigned char*)arenaTryAlloc(size + 1)) == NULL)
+		result = -1; //Size exceeded
+	else {
+		if(size > 0)
+			result = readRange(disk, &sb, inumber, i1, 0, buffer, size) < 0 ? -4 : 1;
+	}
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	if(buffer != NULL && result == 1) {
+		releaseFile(disk, inumber);
+		i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_WRITE);
+		i1 -> compressed = on;
+		returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+		if(size > 0)
+			result = writeRange(disk, inumber, 0, buffer, size);
+	}
+	arenaReset(mark);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	journalEnd(disk);
+	return result;
+}
+
+//Files created from now on are compressed, or not.
+void setDiskCompression(struct Disk* disk, int on) {
+	journalBegin(disk);
+	struct SuperBlock* sb = (struct SuperBlock*)borrowBlock(disk, 0, BLOCK_WRITE);
+	sb -> compress = on;
+	returnBlock(disk, 0);
+	journalEnd(disk);
+}
+
+//Returns the number of bytes copied into buffer, which must hold sizeOfFile
+//bytes.
+int readFile(struct Disk* disk, int inumber, unsigned char* buffer) {
+	long long size = sizeOfFile(disk, inumber);
+	return readFileAt(disk, inumber, 0, buffer, size > INT_MAX ? INT_MAX : size);
+}
+
+long long sizeOfFile(struct Disk* disk, int inumber) {
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+	long long size = i1 -> sizeofFile; //entry count for directories
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	return size;
+}
+
+//Data blocks that emptying the file would give back: the blocks it maps,
+//less those a dedup disk shares with other files. Pointer blocks are left
+//out, so this never promises more than a truncate frees. Callers hold the
+//inode lock.
+long long freeableBlocks(struct Disk* disk, struct SuperBlock* sb, int inumber, struct Inode* i1) {
+	long long i, held = 0, blocks = i1 -> isDirectory ? 0 : (i1 -> sizeofFile + disk -> blockSize - 1) / disk -> blockSize;
+	for(i = 0; i < blocks; i += 1) {
+		int block = bmap(disk, sb, inumber, i1, i, NULL_BLOCK), shared = 0;
+		if(block < 0)
+			continue;
+		if(sb -> dedup) {
+			pthread_mutex_lock(&disk -> dedupLock);
+			shared = (*borrowRefcount(disk, sb, block, BLOCK_READ) & ~REF_INDEXED) > 0;
+			returnRefcount(disk, sb, block);
+			pthread_mutex_unlock(&disk -> dedupLock);
+		}
+		held += !shared;
+	}
+	return held;
+}
+
+//Whether size bytes written over the whole file would fit once its old
+//contents are freed, counting the pointer blocks the new contents need.
+//Callers hold the inode lock.
+int rewriteFits(struct Disk* disk, int inumber, long long size) {
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	struct Inode* i1 = borrowRecord(disk, sb.inode, inumber, sizeof(struct Inode), BLOCK_READ);
+	long long blocks = (size + disk -> blockSize - 1) / disk -> blockSize;
+	long long available = freeDataCount(disk) + freeableBlocks(disk, &sb, inumber, i1);
+	returnRecord(disk, sb.inode, inumber, sizeof(struct Inode));
+	return blocks == 0 || available >= blocks + pointerBlocksFor(blocks, disk -> blockSize) + INDIRECT_LEVELS;
+}
+
+int mountFileSystem(struct Disk* disk, struct Disk* diskMount, char name[10]) {
+	struct SuperBlock sb;
+	struct Mount m1;
+
+	if(!validName((unsigned char*)name))
+		return -3; //Invalid name
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int i, result = 1;
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1 && result == 1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		getMount(disk, sb.mount, i, &m1);
+		if(m1.location == diskMount)
+			result = -2; //Duplicate exists
+	}
+	if(result == 1) {
+		struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+		if((i = allocSlot(disk, sb.mountBitmap, sb.mountCount, &space -> freeMounts, &space -> mountHint)) == -1)
+			result = -1; // Space not available
+		returnSpace(disk);
+	}
+	if(result == 1) {
+		memset(&m1, 0, sizeof(struct Mount));
+		strcpy((char*)m1.diskName, name);
+		m1.location = diskMount;
+		m1.magicNumber = VALID_MAGIC_NUMBER;
+		setMount(disk, sb.mount, i, &m1);
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	mountCacheForget(disk);
+	return result;
+}
+
+int unmountFileSystem(struct Disk* disk, struct Disk* diskMount) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int i, result = -1; //Not mounted here
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1 && result == -1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount* m1 = borrowRecord(disk, sb.mount, i, sizeof(struct Mount), BLOCK_READ);
+		if(m1 -> location == diskMount) {
+			struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+			freeSlot(disk, sb.mountBitmap, i, &space -> freeMounts, &space -> mountHint);
+			returnSpace(disk);
+			result = 1;
+		}
+		returnRecord(disk, sb.mount, i, sizeof(struct Mount));
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	mountCacheForget(disk);
+	return result;
+}
+
+//Flushes, closes and frees every disk mounted on diskBase, used at shutdown.
+void unmountAll(struct Disk* disk) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int i;
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount* m1 = borrowRecord(disk, sb.mount, i, sizeof(struct Mount), BLOCK_READ);
+		struct SpaceCounters* space = borrowSpace(disk, BLOCK_WRITE);
+		freeSlot(disk, sb.mountBitmap, i, &space -> freeMounts, &space -> mountHint);
+		returnSpace(disk);
+		closeDisk(m1 -> location);
+		free(m1 -> location);
+		returnRecord(disk, sb.mount, i, sizeof(struct Mount));
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	mountCacheForget(disk);
+}
+
+//Makes every disk mounted on disk durable, committing journaled ones.
+//Returns -1 if any of them could not be committed.
+int syncAll(struct Disk* disk) {
+	struct SuperBlock sb;
+
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_rdlock(&disk -> namespaceLock);
+	int i, result = 1;
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount m1;
+		getMount(disk, sb.mount, i, &m1);
+		if(syncDisk(m1.location) < 0)
+			result = -1;
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	return result;
+}
+
+int renameFileSystem(struct Disk* disk, struct Disk* diskMount, char name[10]) {
+	struct SuperBlock sb;
+
+	if(!validName((unsigned char*)name))
+		return -3; //Invalid name
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	int i, result = -2; //disk not found
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount* m1 = borrowRecord(disk, sb.mount, i, sizeof(struct Mount), BLOCK_READ);
+		if(m1 -> location != diskMount && strcmp((char*)m1 -> diskName, name) == 0)
+			result = -1; //Duplicate will occur
+		returnRecord(disk, sb.mount, i, sizeof(struct Mount));
+	}
+	for(i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1 && result == -2; i = bitmapNext(disk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount* m1 = borrowRecord(disk, sb.mount, i, sizeof(struct Mount), BLOCK_WRITE);
+		if(m1 -> location == diskMount) {
+			strcpy((char*)m1 -> diskName, name);
+			result = 1;
+		}
+		returnRecord(disk, sb.mount, i, sizeof(struct Mount));
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	mountCacheForget(disk);
+	return result;
+}
+
+//Lists the entries of one directory; subdirectories end in \ and show
+//their entry count instead of a size.
+void ls(struct Disk* disk, int directory) {
+	struct SuperBlock sb;
+	uint64_t started = nowNanos();
+
+	getSuperBlock(disk, &sb);
+	pthread_rwlock_rdlock(&disk -> namespaceLock);
+	int i;
+	for(i = bitmapNext(disk, sb.directoryBitmap, sb.directoryCount, 0, 1); i != -1; i = bitmapNext(disk, sb.directoryBitmap, sb.directoryCount, i + 1, 1)) {
+		struct Directory* d1 = borrowRecord(disk, sb.directory, i, sizeof(struct Directory), BLOCK_READ);
+		if(d1 -> parent == directory) {
+			struct Inode* i1 = borrowRecord(disk, sb.inode, i, sizeof(struct Inode), BLOCK_READ);
+			printf("%d %s%s %lld\n", i, d1 -> fileName, i1 -> isDirectory ? "\\" : "", i1 -> sizeofFile);
+			returnRecord(disk, sb.inode, i, sizeof(struct Inode));
+		}
+		returnRecord(disk, sb.directory, i, sizeof(struct Directory));
+	}
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	recordLatency(OP_LS, started);
+}
+//--------------------------------------------//
+//-------------HOST IO CODE-------------------//
+//Files move in IO_CHUNK pieces through readFileAt and writeFileAt, so
+//nothing is ever staged whole in memory and NUL bytes are just data.
+//Like importFile, a copy that cannot fit leaves the destination alone.
+//A damaged chunk in the source stops the copy with -5.
+int copyFile(struct Disk* diskFrom, int inumberFrom, struct Disk* diskTo, int inumberTo) {
+	if(diskFrom == diskTo && inumberFrom == inumberTo)
+		return 1;
+	pthread_rwlock_rdlock(inodeLock(diskTo, inumberTo));
+	int fits = rewriteFits(diskTo, inumberTo, sizeOfFile(diskFrom, inumberFrom));
+	pthread_rwlock_unlock(inodeLock(diskTo, inumberTo));
+	if(!fits)
+		return -2; //Space not available
+	size_t mark = arenaMark();
+	unsigned char* chunk = (unsigned char*)arenaAlloc(IO_CHUNK);
+	long long offset = 0;
+	int len, result = truncateFile(diskTo, inumberTo, 0);
+	while(result > 0 && (len = readFileAt(diskFrom, inumberFrom, offset, chunk, IO_CHUNK)) != 0) {
+		if(len < 0) {
+			result = -5; //Damaged chunk
+			break;
+		}
+		result = writeFileAt(diskTo, inumberTo, offset, chunk, len);
+		offset += len;
+	}
+	arenaReset(mark);
+	return result;
+}
+
+//The old contents are only dropped once the new ones are known to fit,
+//so running out of space leaves the file as it was. Other writers can
+//still take the room in between, as in writeRange.
+int importFile(struct Disk* disk, int inumber, char* hostPath) {
+	struct stat st;
+	int fd = open(hostPath, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		if(fd >= 0)
+			close(fd);
+		return -4; //Cannot open host file
+	}
+	pthread_rwlock_rdlock(inodeLock(disk, inumber));
+	int fits = rewriteFits(disk, inumber, st.st_size);
+	pthread_rwlock_unlock(inodeLock(disk, inumber));
+	if(!fits) {
+		close(fd);
+		return -2; //Space not available
+	}
+	size_t mark = arenaMark();
+	unsigned char* chunk = (unsigned char*)arenaAlloc(IO_CHUNK);
+	long long offset = 0;
+	int len, result = truncateFile(disk, inumber, 0);
+	while(result > 0 && (len = read(fd, chunk, IO_CHUNK)) != 0) {
+		if(len < 0) {
+			result = -4;
+			break;
+		}
+		result = writeFileAt(disk, inumber, offset, chunk, len);
+		offset += len;
+	}
+	arenaReset(mark);
+	close(fd);
+	return result;
+}
+
+//Writes the whole file to fd. Stops at the first damaged compressed
+//chunk, with what came before it already written.
+int streamFile(struct Disk* disk, int inumber, int fd) {
+	size_t mark = arenaMark();
+	unsigned char* chunk = (unsigned char*)arenaAlloc(IO_CHUNK);
+	long long offset = 0;
+	int len, done, written, result = 1;
+	while(result > 0 && (len = readFileAt(disk, inumber, offset, chunk, IO_CHUNK)) != 0) {
+		if(len < 0) {
+			result = -5; //Damaged chunk
+			break;
+		}
+		for(done = 0; done < len && result > 0; done += written) {
+			written = write(fd, chunk + done, len - done);
+			if(written < 0)
+				result = -4; //Cannot write host file
+		}
+		offset += len;
+	}
+	arenaReset(mark);
+	return result;
+}
+
+int exportFile(struct Disk* disk, int inumber, char* hostPath) {
+	int fd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -4; //Cannot open host file
+	int result = streamFile(disk, inumber, fd);
+	close(fd);
+	return result;
+}
+
+//Mirrors hostDir under directory parent: directories are created right
+//away, regular files are created empty and queued for the workers.
+//Returns the number of entries that could not be mirrored.
+int queueImports(struct ImportQueue* queue, struct Disk* disk, int parent, char* hostDir) {
+	DIR* dir = opendir(hostDir);
+	if(dir == NULL)
+		return 1;
+	struct dirent* entry;
+	struct stat st;
+	char hostPath[PATH_SIZE];
+	int failed = 0, inumber, isDirectory;
+	while((entry = readdir(dir)) != NULL) {
+		if(strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0)
+			continue;
+		if(snprintf(hostPath, PATH_SIZE, "%s/%s", hostDir, entry -> d_name) >= PATH_SIZE || stat(hostPath, &st) < 0) {
+			failed += 1;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode))
+			makeDirectory(disk, parent, (unsigned char*)entry -> d_name);
+		else if(S_ISREG(st.st_mode))
+			createFile(disk, parent, (unsigned char*)entry -> d_name);
+		else
+			continue;
+		inumber = dentryLookup(disk, parent, (unsigned char*)entry -> d_name, &isDirectory);
+		if(inumber == -1 || isDirectory != S_ISDIR(st.st_mode)) {
+			printf("Cannot import %s\n", hostPath);
+			failed += 1;
+		}
+		else if(isDirectory)
+			failed += queueImports(queue, disk, inumber, hostPath);
+		else {
+			if(queue -> count == queue -> capacity) {
+				queue -> capacity = queue -> capacity == 0 ? 64 : queue -> capacity * 2;
+				queue -> jobs = (struct ImportJob*)realloc(queue -> jobs, queue -> capacity * sizeof(struct ImportJob));
+			}
+			struct ImportJob* job = &queue -> jobs[queue -> count];
+			strcpy(job -> hostPath, hostPath);
+			job -> disk = disk;
+			job -> inumber = inumber;
+			job -> result = 0;
+			queue -> count += 1;
+		}
+	}
+	closedir(dir);
+	return failed;
+}
+
+void* importWorker(void* arg) {
+	struct ImportQueue* queue = (struct ImportQueue*)arg;
+	while(1) {
+		pthread_mutex_lock(&queue -> lock);
+		int job = queue -> next;
+		if(job < queue -> count)
+			queue -> next += 1;
+		pthread_mutex_unlock(&queue -> lock);
+		if(job >= queue -> count)
+			break;
+		queue -> jobs[job].result = importFile(queue -> jobs[job].disk, queue -> jobs[job].inumber, queue -> jobs[job].hostPath);
+	}
+	arenaRelease();
+	return NULL;
+}
+
+//Imports every file below hostDir with a pool of threads worker threads.
+//Returns the number of files that failed.
+int importTree(struct Disk* disk, int parent, char* hostDir, int threads) {
+	struct ImportQueue queue;
+	queue.jobs = NULL;
+	queue.count = queue.capacity = queue.next = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+	int i, imported = 0, failed = queueImports(&queue, disk, parent, hostDir);
+	if(threads < 1)
+		threads = 1;
+	pthread_t* workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	for(i = 0; i < threads; i += 1)
+		pthread_create(&workers[i], NULL, importWorker, &queue);
+	for(i = 0; i < threads; i += 1)
+		pthread_join(workers[i], NULL);
+	for(i = 0; i < queue.count; i += 1) {
+		if(queue.jobs[i].result < 0) {
+			printf("Cannot import %s\n", queue.jobs[i].hostPath);
+			failed += 1;
+		}
+		else
+			imported += 1;
+	}
+	printf("%d files imported, %d failed\n", imported, failed);
+	pthread_mutex_destroy(&queue.lock);
+	free(workers);
+	free(queue.jobs);
+	return failed;
+}
+//--------------------------------------------//
+
+
+//-------------JOURNAL CODE-------------------//
+uint64_t journalChecksum(uint64_t hash, unsigned char* data, int len) {
+	uint64_t* words = (uint64_t*)data;
+	int i;
+	for(i = 0; i < len / 8; i += 1)
+		hash = (hash ^ words[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+//Walks the transactions of one sequence after another and stops at the
+//first one that is incomplete. Returns the block after it, or -1 if the
+//transaction starting at pos is not whole. Its blocks are written home
+//when apply is set, and -2 means one of those writes failed.
+int journalTransaction(struct Disk* disk, struct SuperBlock* sb, int pos, int sequence, int apply) {
+	int blockSize = disk -> blockSize, perDescriptor = (blockSize - sizeof(struct JournalDescriptor)) / sizeof(int);
+	unsigned char* region = disk -> buffer + (size_t)sb -> journal * blockSize;
+	uint64_t checksum = 14695981039346656037ULL;
+	int i, logged = 0;
+	while(pos < sb -> journalBlocks) {
+		struct JournalDescriptor* d = (struct JournalDescriptor*)(region + (size_t)pos * blockSize);
+		if(d -> magic == JOURNAL_COMMIT_MAGIC) {
+			struct JournalCommit* c = (struct JournalCommit*)d;
+			if(c -> sequence != sequence || c -> blocks != logged || c -> checksum != checksum)
+				return -1; //Torn commit
+			return pos + 1;
+		}
+		if(d -> magic != JOURNAL_DESCRIPTOR_MAGIC || d -> sequence != sequence || d -> count <= 0
+			|| d -> count > perDescriptor || pos + 1 + d -> count >= sb -> journalBlocks)
+			return -1; //Not part of this transaction
+		checksum = journalChecksum(checksum, (unsigned char*)d, blockSize);
+		for(i = 0; i < d -> count; i += 1) {
+			if(d -> blocks[i] < 0 || d -> blocks[i] >= sb -> journal)
+				return -1; //Only metadata is ever logged
+			unsigned char* copy = region + (size_t)(pos + 1 + i) * blockSize;
+			checksum = journalChecksum(checksum, copy, blockSize);
+			if(apply && pwrite(disk -> fd, copy, blockSize, (off_t)d -> blocks[i] * blockSize) != blockSize)
+				return -2; //Write failed
+		}
+		logged += d -> count;
+		pos += 1 + d -> count;
+	}
+	return -1;
+}
+
+//Runs at attach time, before the cache exists: every committed
+//transaction is written home in order, so the newest copy of a block wins.
+//Reading the log is one sequential pass over the mapped region. Returns
+//the transactions replayed, or -1 if writing them home failed, in which
+//case the log is left as it was for the next attach.
+int journalReplay(struct Disk* disk, struct SuperBlock* sb) {
+	if(sb -> journalBlocks == 0)
+		return 0;
+	struct JournalHeader* header = (struct JournalHeader*)(disk -> buffer + (size_t)sb -> journal * disk -> blockSize);
+	if(header -> magic != JOURNAL_HEADER_MAGIC)
+		return 0;
+	int pos = 1, next, replayed = 0, sequence = header -> sequence;
+	while((next = journalTransaction(disk, sb, pos, sequence, 0)) != -1) {
+		if(journalTransaction(disk, sb, pos, sequence, 1) < 0)
+			return -1;
+		pos = next;
+		sequence += 1;
+		replayed += 1;
+	}
+	if(replayed > 0) {
+		struct JournalHeader fresh = {JOURNAL_HEADER_MAGIC, sequence};
+		if(fdatasync(disk -> fd) != 0
+			|| pwrite(disk -> fd, &fresh, sizeof(fresh), (off_t)sb -> journal * disk -> blockSize) != sizeof(fresh)
+			|| fdatasync(disk -> fd) != 0)
+			return -1;
+	}
+	return replayed;
+}
 
-	while(1) {
-		printf("myfs> ");
-		line = lsh_read_line();
-		args = lsh_split_line(line);
-		//mkfs osfile1 512 10MB
-		if(strcmp(args[0], "mkfs") == 0) {
-			struct Disk* d1 = (struct Disk*)malloc(sizeof(struct Disk));
-			createDisk(d1, atoi(args[3]), atoi(args[2]));
-			createFileSystem(d1);
-			mountFileSystem(root, d1, args[1]);
-		}
-		//use osfile1 as C:
-		else if(strcmp(args[0], "use") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			renameFileSystem(root, p1 -> location, args[3]);
+//Returns -1 if the journal header cannot be read or rewritten; the disk
+//is then left without a journal.
+int journalOpen(struct Disk* disk, struct SuperBlock* sb) {
+	if(sb -> journalBlocks == 0)
+		return 0;
+	struct JournalHeader header;
+	if(pread(disk -> fd, &header, sizeof(header), (off_t)sb -> journal * disk -> blockSize) != sizeof(header))
+		return -1;
+	struct Journal* j = (struct Journal*)malloc(sizeof(struct Journal));
+	j -> start = sb -> journal;
+	j -> blocks = sb -> journalBlocks;
+	j -> head = 1;
+	j -> sequence = header.magic == JOURNAL_HEADER_MAGIC ? header.sequence : 1;
+	j -> pending = j -> committing = 0;
+	j -> lastCommit = nowNanos();
+	//Stale transactions may still follow the header, so start a clean log.
+	header.magic = JOURNAL_HEADER_MAGIC;
+	header.sequence = j -> sequence;
+	if(pwrite(disk -> fd, &header, sizeof(header), (off_t)j -> start * disk -> blockSize) != sizeof(header)) {
+		free(j);
+		return -1;
+	}
+	pthread_rwlock_init(&j -> lock, NULL);
+	disk -> cache -> journaled = 1;
+	disk -> journal = j;
+	return 1;
+}
+
+//Every call that changes metadata runs between journalBegin and journalEnd,
+//so a commit only ever sees whole operations.
+void journalBegin(struct Disk* disk) {
+	if(disk -> journal != NULL)
+		pthread_rwlock_rdlock(&disk -> journal -> lock);
+}
+
+void journalEnd(struct Disk* disk) {
+	struct Journal* j = disk -> journal;
+	if(j == NULL)
+		return;
+	pthread_rwlock_unlock(&j -> lock);
+	int pending = __atomic_add_fetch(&j -> pending, 1, __ATOMIC_RELAXED);
+	int dirty = __atomic_load_n(&disk -> cache -> dirtyCount, __ATOMIC_RELAXED);
+	if(pending < JOURNAL_COMMIT_OPS && dirty < j -> blocks / 4
+		&& nowNanos() - __atomic_load_n(&j -> lastCommit, __ATOMIC_RELAXED) < JOURNAL_COMMIT_NANOS)
+		return;
+	if(__atomic_exchange_n(&j -> committing, 1, __ATOMIC_ACQUIRE) == 0) {
+		journalCommit(disk); //A failed commit keeps its blocks for the next one
+		__atomic_store_n(&j -> committing, 0, __ATOMIC_RELEASE);
+	}
+}
+
+//Group commit: waits for running operations, flushes the data blocks they
+//wrote, logs every dirty metadata block as one transaction and flushes
+//once more. Only then are the blocks written in place, without waiting.
+//Returns the number of blocks logged, or -1 if the log could not be made
+//durable; the blocks then stay dirty in the cache and nothing goes home.
+int journalCommit(struct Disk* disk) {
+	struct Journal* j = disk -> journal;
+	struct BufferCache* cache = disk -> cache;
+	int blockSize = disk -> blockSize, perDescriptor = (blockSize - sizeof(struct JournalDescriptor)) / sizeof(int);
+	int i, k, count = 0, result;
+
+	pthread_rwlock_wrlock(&j -> lock);
+	syncData(disk);
+	pthread_mutex_lock(&cache -> lock);
+	size_t mark = arenaMark();
+	struct CacheFrame** dirty = (struct CacheFrame**)arenaAlloc(cache -> frameCount * sizeof(struct CacheFrame*));
+	for(i = 0; i < cache -> frameCount; i += 1) {
+		if(cache -> frames[i].blockNumber != -1 && cache -> frames[i].dirty)
+			dirty[count++] = &cache -> frames[i];
+	}
+	qsort(dirty, count, sizeof(struct CacheFrame*), compareFrames);
+	int descriptors = (count + perDescriptor - 1) / perDescriptor, needed = count + descriptors + 1;
+	result = count;
+	if(count == 0)
+		;
+	else if(needed > j -> blocks - 1) {
+		//Larger than the whole journal: written in place without protection.
+		flushCache(cache);
+		if(fdatasync(disk -> fd) != 0)
+			result = -1;
+	}
+	else {
+		if(j -> head + needed > j -> blocks) {
+			//Everything logged so far is already home; make sure it is durable
+			//before the log starts over.
+			struct JournalHeader header = {JOURNAL_HEADER_MAGIC, j -> sequence};
+			if(fdatasync(disk -> fd) != 0 || pwrite(disk -> fd, &header, sizeof(header), (off_t)j -> start * blockSize) != sizeof(header))
+				result = -1;
+			else
+				j -> head = 1;
 		}
-		//cp osfile3 C:\tesfile1 
-		else if(strcmp(args[0], "cp") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			partition(args[2], p3, root);
-			if(p3 -> location == NULL) 
-				continue;
-			createFile(p3 -> location, p3 -> fileName);
-			pathResolution(args[2], p2, root);
-			buffer = (unsigned char*)malloc(POINTERS_PER_INODE * p1 -> location -> blockSize);
-			readFile(p1 -> location, p1 -> inumber, buffer);
-			writeFile(p2 -> location, p2 -> inumber, buffer, strlen(buffer));		
-		}
-		//ls C:
-		else if(strcmp(args[0], "ls") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			ls(p1 -> location);
+		if(result > 0) {
+			unsigned char* log = (unsigned char*)arenaAlloc((size_t)needed * blockSize);
+			memset(log, 0, (size_t)needed * blockSize);
+			uint64_t checksum = 14695981039346656037ULL;
+			int pos = 0;
+			for(i = 0; i < count; i += perDescriptor) {
+				struct JournalDescriptor* d = (struct JournalDescriptor*)(log + (size_t)pos * blockSize);
+				d -> magic = JOURNAL_DESCRIPTOR_MAGIC;
+				d -> sequence = j -> sequence;
+				d -> count = min(perDescriptor, count - i);
+				for(k = 0; k < d -> count; k += 1) {
+					d -> blocks[k] = dirty[i + k] -> blockNumber;
+					memcpy(log + (size_t)(pos + 1 + k) * blockSize, dirty[i + k] -> data, blockSize);
+				}
+				checksum = journalChecksum(checksum, log + (size_t)pos * blockSize, (1 + d -> count) * blockSize);
+				pos += 1 + d -> count;
+			}
+			struct JournalCommit* c = (struct JournalCommit*)(log + (size_t)pos * blockSize);
+			c -> magic = JOURNAL_COMMIT_MAGIC;
+			c -> sequence = j -> sequence;
+			c -> blocks = count;
+			c -> checksum = checksum;
+			if(pwrite(disk -> fd, log, (size_t)needed * blockSize, (off_t)(j -> start + j -> head) * blockSize) != (ssize_t)needed * blockSize
+				|| fdatasync(disk -> fd) != 0)
+				result = -1; //Torn log: the next commit writes it again at the same place
+			else {
+				j -> head += needed;
+				j -> sequence += 1;
+				flushCache(cache);
+				statAdd(&disk -> stats.journalCommits, 1);
+				statAdd(&disk -> stats.journalBlocks, count);
+			}
 		}
-		//rm C:\testfile1
-		else if(strcmp(args[0], "rm") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			removeFile(p1 -> location, p1 -> inumber);
+	}
+	arenaReset(mark);
+	pthread_mutex_unlock(&cache -> lock);
+	if(result >= 0 && disk -> freedLow != -1) {
+		struct SuperBlock sb;
+		getSuperBlock(disk, &sb);
+		discardFreeChunks(disk, &sb, disk -> freedLow, disk -> freedHigh);
+		disk -> freedLow = disk -> freedHigh = -1;
+	}
+	__atomic_store_n(&j -> pending, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&j -> lastCommit, nowNanos(), __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&j -> lock);
+	return result;
+}
+
+//After a final commit everything is home, so the log is emptied and the
+//next attach has nothing to replay. If the commit or the emptying fails
+//the log is kept, and -1 is returned.
+int journalClose(struct Disk* disk) {
+	struct Journal* j = disk -> journal;
+	int result = -1;
+	if(journalCommit(disk) >= 0 && fdatasync(disk -> fd) == 0) {
+		struct JournalHeader header = {JOURNAL_HEADER_MAGIC, j -> sequence};
+		if(pwrite(disk -> fd, &header, sizeof(header), (off_t)j -> start * disk -> blockSize) == sizeof(header)
+			&& fdatasync(disk -> fd) == 0)
+			result = 1;
+	}
+	pthread_rwlock_destroy(&j -> lock);
+	free(j);
+	disk -> journal = NULL;
+	disk -> cache -> journaled = 0;
+	return result;
+}
+//--------------------------------------------//
+
+//-------------COMPRESSION CODE---------------//
+unsigned int read32(unsigned char* p) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+//Writes a length that does not fit in its token nibble as a run of 255s
+//and a final byte.
+int lz4PutLength(unsigned char* dst, int out, int dstCapacity, int length) {
+	for(; length >= 255; length -= 255) {
+		if(out >= dstCapacity)
+			return -1;
+		dst[out++] = 255;
+	}
+	if(out >= dstCapacity)
+		return -1;
+	dst[out++] = length;
+	return out;
+}
+
+//Emits one sequence: literals, then a match unless matchLength is 0.
+int lz4PutSequence(unsigned char* dst, int out, int dstCapacity, unsigned char* literals, int literalLength, int offset, int matchLength) {
+	if(out >= dstCapacity)
+		return -1;
+	int token = out++;
+	dst[token] = (literalLength < 15 ? literalLength : 15) << 4;
+	if(literalLength >= 15 && (out = lz4PutLength(dst, out, dstCapacity, literalLength - 15)) < 0)
+		return -1;
+	if(out + literalLength > dstCapacity)
+		return -1;
+	memcpy(dst + out, literals, literalLength);
+	out += literalLength;
+	if(matchLength == 0)
+		return out;
+	if(out + 2 > dstCapacity)
+		return -1;
+	dst[out++] = offset & 0xff;
+	dst[out++] = offset >> 8;
+	matchLength -= LZ4_MIN_MATCH;
+	dst[token] |= matchLength < 15 ? matchLength : 15;
+	if(matchLength >= 15 && (out = lz4PutLength(dst, out, dstCapacity, matchLength - 15)) < 0)
+		return -1;
+	return out;
+}
+
+//Greedy single pass with a hash table of the last position each 4 byte
+//sequence was seen at. Returns the compressed length, or -1 when it would
+//not fit in dstCapacity bytes.
+int lz4Compress(unsigned char* src, int srcLen, unsigned char* dst, int dstCapacity) {
+	int table[1 << LZ4_HASH_BITS];
+	int pos = 0, anchor = 0, out = 0;
+	memset(table, 0xff, sizeof(table));
+	while(pos < srcLen - LZ4_MATCH_LIMIT) {
+		unsigned int sequence = read32(src + pos), hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		int ref = table[hash];
+		table[hash] = pos;
+		if(ref < 0 || pos - ref > LZ4_MAX_OFFSET || read32(src + ref) != sequence) {
+			pos += 1;
+			continue;
 		}
-		//mv D:\testfile2 D:\testfile2a
-		else if(strcmp(args[0], "mv") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			partition(args[2], p3, root);
-			if(p3 -> location == NULL) 
-				continue;
-			createFile(p3 -> location, p3 -> fileName);
-			pathResolution(args[2], p2, root);
-			if(p2 -> location == NULL && p2 -> inumber == -1) 
-				continue;
-			buffer = (unsigned char*)malloc(POINTERS_PER_INODE * p1 -> location -> blockSize);
-			readFile(p1 -> location, p1 -> inumber, buffer);
-			writeFile(p2 -> location, p2 -> inumber, buffer, strlen(buffer));
-			removeFile(p1 -> location, p1 -> inumber);		
-		}
-		//create C: filename
-		else if(strcmp(args[0], "create") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-			createFile(p1 -> location, args[2]);
+		while(pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1]) {
+			pos -= 1;
+			ref -= 1;
 		}
-		//display C:\filename
-		else if(strcmp(args[0], "display") == 0) {
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
-				continue;
-//			printf("%d %s %d\n", p1 -> location, args[1], p1 -> inumber);
-			buffer = (unsigned char*)malloc(POINTERS_PER_INODE * p1 -> location -> blockSize);
-			readFile(p1 -> location, p1 -> inumber, buffer);
-			printf("%s\n", buffer);
-		}
-		//write C:\filename
-		else if(strcmp(args[0], "write") == 0) {
-			partition(args[1], p3, root);
-			if(p3 -> location == NULL) 
+		int length = LZ4_MIN_MATCH;
+		while(pos + length < srcLen - LZ4_LAST_LITERALS && src[pos + length] == src[ref + length])
+			length += 1;
+		if((out = lz4PutSequence(dst, out, dstCapacity, src + anchor, pos - anchor, pos - ref, length)) < 0)
+			return -1;
+		pos += length;
+		anchor = pos;
+	}
+	return lz4PutSequence(dst, out, dstCapacity, src + anchor, srcLen - anchor, 0, 0);
+}
+
+//Returns the decompressed length, or -1 when src is not a valid block or
+//does not fit in dstCapacity bytes.
+int lz4Decompress(unsigned char* src, int srcLen, unsigned char* dst, int dstCapacity) {
+	int in = 0, out = 0;
+	while(in < srcLen) {
+		int token = src[in++], length = token >> 4, more;
+		if(length == 15) {
+			do {
+				if(in >= srcLen)
+					return -1;
+				more = src[in++];
+				length += more;
+			} while(more == 255);
+		}
+		if(length > srcLen - in || length > dstCapacity - out)
+			return -1;
+		memcpy(dst + out, src + in, length);
+		in += length;
+		out += length;
+		if(in == srcLen)
+			break; //The last sequence has no match
+		if(in + 2 > srcLen)
+			return -1;
+		int offset = src[in] | src[in + 1] << 8;
+		in += 2;
+		length = (token & 15) + LZ4_MIN_MATCH;
+		if((token & 15) == 15) {
+			do {
+				if(in >= srcLen)
+					return -1;
+				more = src[in++];
+				length += more;
+			} while(more == 255);
+		}
+		if(offset == 0 || offset > out || length > dstCapacity - out)
+			return -1;
+		unsigned char* from = dst + out - offset;
+		if(offset >= length)
+			memcpy(dst + out, from, length);
+		else {
+			int i;
+			for(i = 0; i < length; i += 1)
+				dst[out + i] = from[i]; //Overlapping copies repeat the pattern
+		}
+		out += length;
+	}
+	return out;
+}
+//--------------------------------------------//
+
+//---------------STATS CODE-------------------//
+void statAdd(uint64_t* counter, uint64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+uint64_t statGet(uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t nowNanos() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+//Values below HIST_SUB_BUCKETS get a bucket each; above that a bucket
+//covers 1/HIST_SUB_BUCKETS of its power of two.
+int latencyBucket(uint64_t nanos) {
+	if(nanos < HIST_SUB_BUCKETS)
+		return nanos;
+	int power = 63 - __builtin_clzll(nanos);
+	int bucket = (power - 2) * HIST_SUB_BUCKETS + (int)((nanos >> (power - 3)) & (HIST_SUB_BUCKETS - 1));
+	return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+uint64_t bucketLow(int bucket) {
+	if(bucket < HIST_SUB_BUCKETS)
+		return bucket;
+	return (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (bucket / HIST_SUB_BUCKETS - 1);
+}
+
+void recordLatency(int op, uint64_t started) {
+	struct LatencyHistogram* h = &opLatency[op];
+	uint64_t nanos = nowNanos() - started;
+	statAdd(&h -> count, 1);
+	statAdd(&h -> totalNanos, nanos);
+	statAdd(&h -> buckets[latencyBucket(nanos)], 1);
+	uint64_t max = statGet(&h -> maxNanos);
+	while(nanos > max && !__atomic_compare_exchange_n(&h -> maxNanos, &max, nanos, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//Upper end of the bucket holding the q-th quantile, capped by the maximum.
+uint64_t latencyPercentile(struct LatencyHistogram* h, double q) {
+	uint64_t count = statGet(&h -> count), seen = 0, max = statGet(&h -> maxNanos);
+	int i;
+	if(count == 0)
+		return 0;
+	for(i = 0; i < HIST_BUCKETS - 1; i += 1) {
+		seen += statGet(&h -> buckets[i]);
+		if(seen >= q * count)
+			break;
+	}
+	uint64_t high = bucketLow(i + 1) - 1;
+	return high < max ? high : max;
+}
+
+void printJsonString(unsigned char* text) {
+	putchar('"');
+	for(; *text != 0; text += 1) {
+		if(*text == '"' || *text == '\\')
+			putchar('\\');
+		putchar(*text);
+	}
+	putchar('"');
+}
+
+void printDiskStats(unsigned char* name, struct DiskStats* stats, int json, int first) {
+	if(json) {
+		printf("%s{\"name\":", first ? "" : ",");
+		printJsonString(name);
+		printf(",\"blockReads\":%llu,\"blockWrites\":%llu,\"bytesRead\":%llu,\"bytesWritten\":%llu,"
+			"\"allocations\":%llu,\"allocWords\":%llu,\"pathSteps\":%llu,\"journalCommits\":%llu,\"journalBlocks\":%llu,\"sharedBlocks\":%llu,"
+			"\"prefetchBlocks\":%llu}",
+			(unsigned long long)statGet(&stats -> blockReads), (unsigned long long)statGet(&stats -> blockWrites),
+			(unsigned long long)statGet(&stats -> bytesRead), (unsigned long long)statGet(&stats -> bytesWritten),
+			(unsigned long long)statGet(&stats -> allocations), (unsigned long long)statGet(&stats -> allocWords),
+			(unsigned long long)statGet(&stats -> pathSteps), (unsigned long long)statGet(&stats -> journalCommits),
+			(unsigned long long)statGet(&stats -> journalBlocks), (unsigned long long)statGet(&stats -> sharedBlocks),
+			(unsigned long long)statGet(&stats -> prefetchBlocks));
+	}
+	else
+		printf("%-10s %12llu %12llu %14llu %14llu %11llu %11llu %11llu %11llu %11llu %11llu %11llu\n", name,
+			(unsigned long long)statGet(&stats -> blockReads), (unsigned long long)statGet(&stats -> blockWrites),
+			(unsigned long long)statGet(&stats -> bytesRead), (unsigned long long)statGet(&stats -> bytesWritten),
+			(unsigned long long)statGet(&stats -> allocations), (unsigned long long)statGet(&stats -> allocWords),
+			(unsigned long long)statGet(&stats -> pathSteps), (unsigned long long)statGet(&stats -> journalCommits),
+			(unsigned long long)statGet(&stats -> journalBlocks), (unsigned long long)statGet(&stats -> sharedBlocks),
+			(unsigned long long)statGet(&stats -> prefetchBlocks));
+}
+
+//Prints the counters of rootDisk and every disk mounted on it, then the
+//latency of each operation, as a table or as one JSON object.
+void printStats(struct Disk* rootDisk, int json) {
+	struct SuperBlock sb;
+	int i, op;
+	getSuperBlock(rootDisk, &sb);
+	if(json)
+		printf("{\"disks\":[");
+	else
+		printf("%-10s %12s %12s %14s %14s %11s %11s %11s %11s %11s %11s %11s\n", "disk", "block reads", "block writes",
+			"bytes read", "bytes written", "allocations", "alloc words", "path steps", "commits", "logged", "shared", "prefetched");
+	printDiskStats((unsigned char*)"\\", &rootDisk -> stats, json, 1);
+	pthread_rwlock_rdlock(&rootDisk -> namespaceLock);
+	for(i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount m1;
+		getMount(rootDisk, sb.mount, i, &m1);
+		printDiskStats(m1.diskName, &m1.location -> stats, json, 0);
+	}
+	pthread_rwlock_unlock(&rootDisk -> namespaceLock);
+	if(json)
+		printf("],\"latency\":{");
+	else
+		printf("\n%-10s %12s %12s %12s %12s %12s %12s\n", "op (us)", "count", "mean", "p50", "p90", "p99", "max");
+	for(op = 0; op < OP_COUNT; op += 1) {
+		struct LatencyHistogram* h = &opLatency[op];
+		uint64_t count = statGet(&h -> count);
+		double mean = count == 0 ? 0 : statGet(&h -> totalNanos) / 1e3 / count;
+		if(json == 0) {
+			printf("%-10s %12llu %12.2f %12.2f %12.2f %12.2f %12.2f\n", opNames[op], (unsigned long long)count, mean,
+				latencyPercentile(h, 0.5) / 1e3, latencyPercentile(h, 0.9) / 1e3, latencyPercentile(h, 0.99) / 1e3,
+				statGet(&h -> maxNanos) / 1e3);
+			continue;
+		}
+		printf("%s\"%s\":{\"count\":%llu,\"meanUs\":%.3f,\"p50Us\":%.3f,\"p90Us\":%.3f,\"p99Us\":%.3f,\"maxUs\":%.3f,\"buckets\":[",
+			op == 0 ? "" : ",", opNames[op], (unsigned long long)count, mean,
+			latencyPercentile(h, 0.5) / 1e3, latencyPercentile(h, 0.9) / 1e3, latencyPercentile(h, 0.99) / 1e3,
+			statGet(&h -> maxNanos) / 1e3);
+		int first = 1;
+		for(i = 0; i < HIST_BUCKETS; i += 1) {
+			uint64_t n = statGet(&h -> buckets[i]);
+			if(n == 0)
 				continue;
-			createFile(p3 -> location, p3 -> fileName);
-			pathResolution(args[1], p1, root);
-			if(p1 -> location == NULL && p1 -> inumber == -1) 
+			printf("%s[%llu,%llu]", first ? "" : ",", (unsigned long long)bucketLow(i), (unsigned long long)n);
+			first = 0;
+		}
+		printf("]}");
+	}
+	if(json)
+		printf("}}\n");
+}
+
+void resetCounters(uint64_t* counters, int count) {
+	int i;
+	for(i = 0; i < count; i += 1)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+void resetStats(struct Disk* rootDisk) {
+	struct SuperBlock sb;
+	int i;
+	getSuperBlock(rootDisk, &sb);
+	resetCounters((uint64_t*)&rootDisk -> stats, sizeof(struct DiskStats) / sizeof(uint64_t));
+	pthread_rwlock_rdlock(&rootDisk -> namespaceLock);
+	for(i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount m1;
+		getMount(rootDisk, sb.mount, i, &m1);
+		resetCounters((uint64_t*)&m1.location -> stats, sizeof(struct DiskStats) / sizeof(uint64_t));
+	}
+	pthread_rwlock_unlock(&rootDisk -> namespaceLock);
+	resetCounters((uint64_t*)opLatency, sizeof(opLatency) / (sizeof(uint64_t)));
+}
+
+void printDiskUsage(unsigned char* name, struct Disk* disk) {
+	struct SuperBlock sb;
+	getSuperBlock(disk, &sb);
+	struct SpaceCounters* space = borrowSpace(disk, BLOCK_READ);
+	int freeData = __atomic_load_n(&space -> freeData, __ATOMIC_RELAXED);
+	int freeInodes = __atomic_load_n(&space -> freeInodes, __ATOMIC_RELAXED);
+	returnSpace(disk);
+	printf("%-10s %10d %12d %12d %12d %5.1f%% %12d %12d %12d\n", name, sb.blockSize, sb.dataCount, sb.dataCount - freeData, freeData,
+		sb.dataCount == 0 ? 0.0 : 100.0 * (sb.dataCount - freeData) / sb.dataCount, sb.inodeCount, sb.inodeCount - freeInodes, freeInodes);
+}
+
+//Prints the data blocks and inodes used on rootDisk and every disk mounted
+//on it. Only the superblock counters are read, never a bitmap.
+void printUsage(struct Disk* rootDisk) {
+	struct SuperBlock sb;
+	int i;
+	getSuperBlock(rootDisk, &sb);
+	printf("%-10s %10s %12s %12s %12s %6s %12s %12s %12s\n", "disk", "block size", "blocks", "used", "free", "use", "inodes", "iused", "ifree");
+	printDiskUsage((unsigned char*)"\\", rootDisk);
+	pthread_rwlock_rdlock(&rootDisk -> namespaceLock);
+	for(i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, 0, 1); i != -1; i = bitmapNext(rootDisk, sb.mountBitmap, sb.mountCount, i + 1, 1)) {
+		struct Mount m1;
+		getMount(rootDisk, sb.mount, i, &m1);
+		printDiskUsage(m1.diskName, m1.location);
+	}
+	pthread_rwlock_unlock(&rootDisk -> namespaceLock);
+}
+//--------------------------------------------//
+
+//---------------FSCK CODE--------------------//
+//Checks disk against what its inode table references and, with repair,
+//fixes what can be fixed. Every other operation on the disk waits until the
+//check is done. Workers first walk the inode table in batches, counting
+//the references to each data block and the entries of each directory, and
+//then compare those counts with the bitmaps and tables batch by batch.
+//Returns the number of problems found.
+long long checkFileSystem(struct Disk* disk, int repair, int threads, struct FsckReport* report) {
+	struct FsckJob job;
+	pthread_t workers[FSCK_MAX_THREADS];
+	int i;
+
+	getSuperBlock(disk, &job.sb);
+	journalBegin(disk);
+	pthread_rwlock_wrlock(&disk -> namespaceLock);
+	for(i = 0; i < INODE_LOCKS; i += 1)
+		pthread_rwlock_wrlock(&disk -> inodeLocks[i]);
+	job.disk = disk;
+	job.repair = repair;
+	job.refs = (unsigned int*)calloc(job.sb.dataCount, sizeof(unsigned int));
+	job.entries = (int*)calloc(job.sb.inodeCount, sizeof(int));
+	memset(&job.report, 0, sizeof(struct FsckReport));
+	pthread_mutex_init(&job.lock, NULL);
+	threads = threads < 1 ? 1 : min(threads, FSCK_MAX_THREADS);
+	int inodeBatches = (job.sb.inodeCount + FSCK_BATCH - 1) / FSCK_BATCH;
+	int blockBatches = (job.sb.dataCount + FSCK_BATCH - 1) / FSCK_BATCH;
+	for(job.phase = 1; job.phase <= 2; job.phase += 1) {
+		job.next = 0;
+		job.batches = job.phase == 1 ? inodeBatches : (inodeBatches > blockBatches ? inodeBatches : blockBatches);
+		for(i = 0; i < threads; i += 1)
+			pthread_create(&workers[i], NULL, fsckWorker, &job);
+		for(i = 0; i < threads; i += 1)
+			pthread_join(workers[i], NULL);
+	}
+
+	//The bitmaps are final now, so the free counters can be checked.
+	struct SpaceCounters counted;
+	counted.freeInodes = bitmapCountFree(disk, job.sb.directoryBitmap, job.sb.inodeCount, job.sb.inodeCount);
+	counted.freeMounts = bitmapCountFree(disk, job.sb.mountBitmap, job.sb.mountCount, job.sb.mountCount);
+	counted.freeData = bitmapCountFree(disk, job.sb.dataBitmap, job.sb.dataCount, job.sb.dataCount);
+	counted.inodeHint = counted.mountHint = counted.dataHint = 0;
+	struct SpaceCounters* space = borrowSpace(disk, BLOCK_READ);
+	job.report.counters = (space -> freeInodes != counted.freeInodes) + (space -> freeMounts != counted.freeMounts)
+		+ (space -> freeData != counted.freeData);
+	returnSpace(disk);
+	if(repair && job.report.counters > 0) {
+		memcpy(borrowSpace(disk, BLOCK_WRITE), &counted, sizeof(struct SpaceCounters));
+		returnSpace(disk);
+	}
+
+	free(job.refs);
+	free(job.entries);
+	pthread_mutex_destroy(&job.lock);
+	for(i = 0; i < INODE_LOCKS; i += 1)
+		pthread_rwlock_unlock(&disk -> inodeLocks[i]);
+	pthread_rwlock_unlock(&disk -> namespaceLock);
+	journalEnd(disk);
+	*report = job.report;
+	return report -> badPointers + report -> leaked + report -> lost + report -> crossLinked + report -> refcounts
+		+ report -> slots + report -> badEntries + report -> entryCounts + report -> counters;
+}
+
+void* fsckWorker(void* arg) {
+	struct FsckJob* job = (struct FsckJob*)arg;
+	struct FsckReport report;
+	size_t i;
+	int batch;
+	memset(&report, 0, sizeof(struct FsckReport));
+	while((batch = __atomic_fetch_add(&job -> next, 1, __ATOMIC_RELAXED)) < job -> batches) {
+		if(job -> phase == 1)
+			fsckInodes(job, &report, batch * FSCK_BATCH);
+		else
+			fsckBlocks(job, &report, batch * FSCK_BATCH);
+	}
+	pthread_mutex_lock(&job -> lock);
+	for(i = 0; i < sizeof(struct FsckReport) / sizeof(long long); i += 1)
+		((long long*)&job -> report)[i] += ((long long*)&report)[i];
+	pthread_mutex_unlock(&job -> lock);
+	return NULL;
+}
+
+//Counts one reference to block. Returns 0 when it points outside the data
+//region, and repair then replaces the pointer with a hole.
+int fsckReference(struct FsckJob* job, struct FsckReport* report, int block, unsigned int amount) {
+	if(block < 0 || block >= job -> sb.dataCount) {
+		report -> badPointers += 1;
+		return 0;
+	}
+	__atomic_fetch_add(&job -> refs[block], amount, __ATOMIC_RELAXED);
+	return 1;
+}
+
+//Counts the references held by a pointer block of the given depth.
+void fsckTree(struct FsckJob* job, struct FsckReport* report, int inumber, int block, int depth) {
+	struct Disk* disk = job -> disk;
+	int i, fixed = 0, perBlock = disk -> blockSize / sizeof(int);
+	int* pointers = (int*)borrowBlock(disk, job -> sb.data + block, BLOCK_READ);
+	for(i = 0; i < perBlock; i += 1) {
+		int pointer = pointers[i];
+		if(pointer < 0)
+			continue; //Hole or compressed chunk mark
+		if(fsckReference(job, report, pointer, depth > 0 ? FSCK_POINTER : 1) == 0) {
+			if(job -> repair) {
+				((int*)borrowBlock(disk, job -> sb.data + block, BLOCK_WRITE))[i] = NULL_BLOCK;
+				returnBlock(disk, job -> sb.data + block);
+				fixed = 1;
+			}
+		}
+		else if(depth > 0)
+			fsckTree(job, report, inumber, pointer, depth - 1);
+	}
+	returnBlock(disk, job -> sb.data + block);
+	//A cached leaf lookup could still hand out the pointer just dropped.
+	if(fixed)
+		mapCacheForget(disk, inumber);
+}
+
+//Walks the inodes [first, first + FSCK_BATCH). Only the directory bit says
+//whether a slot is in use, since that is the bitmap inodes are allocated from.
+void fsckInodes(struct FsckJob* job, struct FsckReport* report, int first) {
+	struct Disk* disk = job -> disk;
+	struct SuperBlock* sb = &job -> sb;
+	int bitsPerBlock = disk -> blockSize * 8, last = min(first + FSCK_BATCH, sb -> inodeCount), i, k;
+	uint64_t* inodeWords = (uint64_t*)borrowBlock(disk, sb -> inodeBitmap + first / bitsPerBlock, BLOCK_READ);
+	uint64_t* directoryWords = (uint64_t*)borrowBlock(disk, sb -> directoryBitmap + first / bitsPerBlock, BLOCK_READ);
+	for(i = first; i < last; i += 1) {
+		int w = (i % bitsPerBlock) / 64;
+		uint64_t bit = (uint64_t)1 << (i % 64);
+		int live = (__atomic_load_n(&directoryWords[w], __ATOMIC_RELAXED) & bit) != 0;
+		if(live != ((__atomic_load_n(&inodeWords[w], __ATOMIC_RELAXED) & bit) != 0)) {
+			report -> slots += 1;
+			if(job -> repair)
+				bitmapSet(disk, sb -> inodeBitmap, i, live);
+		}
+		if(live == 0)
+			continue;
+
+		struct Directory d1;
+		getDirectory(disk, sb -> directory, i, &d1);
+		//An entry has to name its own slot and sit in a live directory.
+		int parent = d1.parent, bad = d1.inumber != i;
+		if(parent == -1)
+			;
+		else if(parent < 0 || parent >= sb -> inodeCount || bitmapTest(disk, sb -> directoryBitmap, parent) == 0)
+			bad = 1;
+		else {
+			struct Inode* dir = borrowRecord(disk, sb -> inode, parent, sizeof(struct Inode), BLOCK_READ);
+			bad |= dir -> isDirectory == 0;
+			returnRecord(disk, sb -> inode, parent, sizeof(struct Inode));
+		}
+		if(bad)
+			report -> badEntries += 1;
+		else if(parent != -1)
+			__atomic_fetch_add(&job -> entries[parent], 1, __ATOMIC_RELAXED);
+
+		struct Inode i1;
+		int changed = 0;
+		getInode(disk, sb -> inode, i, &i1);
+		if(i1.isDirectory)
+			report -> directories += 1;
+		else
+			report -> files += 1;
+		for(k = 0; k < POINTERS_PER_INODE; k += 1) {
+			if(i1.blockNumbers[k] >= 0 && fsckReference(job, report, i1.blockNumbers[k], 1) == 0) {
+				i1.blockNumbers[k] = NULL_BLOCK;
+				changed = 1;
+			}
+		}
+		for(k = 0; k < INDIRECT_LEVELS; k += 1) {
+			if(i1.indirect[k] == NULL_BLOCK)
 				continue;
-//			printf("%d %s %d\n", p3 -> location, p3 -> fileName, p1 -> inumber);
-			line = lsh_read_line();
-			writeFile(p1 -> location, p1 -> inumber, line, strlen(line));
+			if(fsckReference(job, report, i1.indirect[k], FSCK_POINTER) == 0) {
+				i1.indirect[k] = NULL_BLOCK;
+				changed = 1;
+			}
+			else
+				fsckTree(job, report, i, i1.indirect[k], k);
+		}
+		if(changed && job -> repair) {
+			setInode(disk, sb -> inode, i, &i1);
+			mapCacheForget(disk, i);
+		}
+	}
+	returnBlock(disk, sb -> directoryBitmap + first / bitsPerBlock);
+	returnBlock(disk, sb -> inodeBitmap + first / bitsPerBlock);
+}
+
+//Compares the data blocks [first, first + FSCK_BATCH) with the references
+//counted by the walk, and the directories among the inodes of the same
+//range with their entries.
+void fsckBlocks(struct FsckJob* job, struct FsckReport* report, int first) {
+	struct Disk* disk = job -> disk;
+	struct SuperBlock* sb = &job -> sb;
+	int bitsPerBlock = disk -> blockSize * 8, last = min(first + FSCK_BATCH, sb -> dataCount), i;
+	if(first < last) {
+		uint64_t* words = (uint64_t*)borrowBlock(disk, sb -> dataBitmap + first / bitsPerBlock, BLOCK_READ);
+		for(i = first; i < last; i += 1) {
+			unsigned int refs = job -> refs[i], pointers = refs / FSCK_POINTER, data = refs % FSCK_POINTER;
+			int used = (__atomic_load_n(&words[(i % bitsPerBlock) / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+			report -> blocks += refs != 0;
+			if(used && refs == 0) {
+				report -> leaked += 1;
+				if(job -> repair)
+					bitmapSet(disk, sb -> dataBitmap, i, 0);
+			}
+			else if(used == 0 && refs != 0) {
+				report -> lost += 1;
+				if(job -> repair)
+					bitmapSet(disk, sb -> dataBitmap, i, 1);
+			}
+			//Only data blocks of a dedup disk may be shared.
+			if(pointers + (data > 0) > 1 || (data > 1 && sb -> dedup == 0))
+				report -> crossLinked += 1;
+			if(sb -> dedup)
+				fsckRefcount(job, report, i, pointers == 0 && data > 0 ? data - 1 : 0, pointers == 0 && data > 0);
+		}
+		returnBlock(disk, sb -> dataBitmap + first / bitsPerBlock);
+	}
+	last = min(first + FSCK_BATCH, sb -> inodeCount);
+	for(i = first; i < last; i += 1) {
+		if(bitmapTest(disk, sb -> directoryBitmap, i) == 0)
+			continue;
+		struct Inode* i1 = borrowRecord(disk, sb -> inode, i, sizeof(struct Inode), BLOCK_READ);
+		int wrong = i1 -> isDirectory && i1 -> sizeofFile != job -> entries[i];
+		returnRecord(disk, sb -> inode, i, sizeof(struct Inode));
+		if(wrong == 0)
+			continue;
+		report -> entryCounts += 1;
+		if(job -> repair) {
+			i1 = borrowRecord(disk, sb -> inode, i, sizeof(struct Inode), BLOCK_WRITE);
+			i1 -> sizeofFile = job -> entries[i];
+			returnRecord(disk, sb -> inode, i, sizeof(struct Inode));
 		}
-		//exit
-		else if(strcmp(args[0], "exit") == 0)
+	}
+}
+
+//A block's stored count is its references less one. Only shared candidates,
+//data blocks in use, may stay in the fingerprint index.
+void fsckRefcount(struct FsckJob* job, struct FsckReport* report, int block, unsigned int expected, int mayIndex) {
+	struct Disk* disk = job -> disk;
+	struct SuperBlock* sb = &job -> sb;
+	unsigned int stored = *borrowRefcount(disk, sb, block, BLOCK_READ);
+	returnRefcount(disk, sb, block);
+	int indexed = (stored & REF_INDEXED) != 0;
+	if((stored & ~REF_INDEXED) == expected && (mayIndex || indexed == 0))
+		return;
+	report -> refcounts += 1;
+	if(job -> repair == 0)
+		return;
+	if(indexed && mayIndex == 0) {
+		pthread_mutex_lock(&disk -> dedupLock);
+		fingerprintRemove(disk, sb, blockHash(borrowBlock(disk, sb -> data + block, BLOCK_READ), disk -> blockSize), block);
+		returnBlock(disk, sb -> data + block);
+		pthread_mutex_unlock(&disk -> dedupLock);
+		indexed = 0;
+	}
+	*borrowRefcount(disk, sb, block, BLOCK_WRITE) = expected | (indexed ? REF_INDEXED : 0);
+	returnRefcount(disk, sb, block);
+}
+
+long long fsckUnfixable(struct FsckReport* report) {
+	return report -> crossLinked + report -> badEntries;
+}
+
+void printFsckReport(struct FsckReport* report, double seconds) {
+	printf("%lld files, %lld directories, %lld blocks in use, checked in %.3f s\n", report -> files, report -> directories, report -> blocks, seconds);
+	printf("bad pointers %lld, leaked %lld, lost %lld, cross-linked %lld, refcounts %lld\n", report -> badPointers, report -> leaked,
+		report -> lost, report -> crossLinked, report -> refcounts);
+	printf("inode slots %lld, bad entries %lld, entry counts %lld, counters %lld\n", report -> slots, report -> badEntries,
+		report -> entryCounts, report -> counters);
+}
+//--------------------------------------------//
+
+//---------------SHELL CODE-------------------//
+#define COMMANDS 29
+
+//Operands a command cannot run without. They are checked before the
+//command runs, so a short line fails with its usage instead of reaching
+//a missing operand.
+struct CommandUsage {
+	char* name;
+	char* flag; //matches only when the first operand is this, NULL for any
+	int operands;
+	char* usage;
+};
+
+struct CommandUsage commandUsage[COMMANDS] = {
+	{"mkfs", NULL, 3, "mkfs drive_name block_size total_size [image_file] [-compress] [-dedup] [-inode-ratio bytes] [-mounts n] [-file-size bytes]"},
+	{"attach", NULL, 2, "attach drive_name image_file"},
+	{"detach", NULL, 1, "detach drive_name"},
+	{"cache", NULL, 1, "cache drive_name [frames]"},
+	{"compress", NULL, 1, "compress drive_name[\\file_name] [on|off]"},
+	{"sync", NULL, 0, "sync [drive_name]"},
+	{"use", NULL, 3, "use drive_name as other_name"},
+	{"cp", NULL, 2, "cp source_file drive_name\\dest_file"},
+	{"import", "-r", 3, "import -r host_dir drive_name\\dir [threads]"},
+	{"import", NULL, 2, "import host_file drive_name\\dest_file"},
+	{"export", NULL, 2, "export drive_name\\file_name host_file"},
+	{"ls", NULL, 0, "ls [drive_name\\dir]"},
+	{"rm", NULL, 1, "rm drive_name\\file_name"},
+	{"mkdir", NULL, 1, "mkdir drive_name\\dir"},
+	{"rmdir", NULL, 1, "rmdir drive_name\\dir"},
+	{"cd", NULL, 0, "cd [drive_name\\dir]"},
+	{"pwd", NULL, 0, "pwd"},
+	{"mv", NULL, 2, "mv drive_1\\source_file drive_2\\dest_file"},
+	{"create", NULL, 2, "create drive_name file_name"},
+	{"write", NULL, 1, "write drive_name\\file_name"},
+	{"display", NULL, 1, "display drive_name\\file_name"},
+	{"pread", NULL, 1, "pread drive_name\\file_name offset length"},
+	{"pwrite", NULL, 1, "pwrite drive_name\\file_name offset"},
+	{"append", NULL, 1, "append drive_name\\file_name"},
+	{"truncate", NULL, 1, "truncate drive_name\\file_name size"},
+	{"stats", NULL, 0, "stats [reset|json]"},
+	{"df", NULL, 0, "df"},
+	{"fsck", NULL, 1, "fsck drive_name [repair] [threads]"},
+	{"exit", NULL, 0, "exit"}
+};
+
+//Runs one command line. Returns 1 on exit, -1 if the command failed and
+//0 otherwise. Commands that take a data line read it from input.
+int runCommand(char** args, struct Disk* root, struct Path* cwd, struct LineReader* input) {
+	struct Path path1, path2;
+	struct PseudoPath pseudo;
+	struct Path* p1 = &path1;
+	struct Path* p2 = &path2;
+	struct PseudoPath* p3 = &pseudo;
+	unsigned char* buffer;
+	char* line;
+	int i, j;
+
+	for(i = 0; i < COMMANDS; i += 1) {
+		struct CommandUsage* c = &commandUsage[i];
+		if(strcmp(args[0], c -> name) == 0 && (c -> flag == NULL || (args[1] != NULL && strcmp(args[1], c -> flag) == 0)))
 			break;
 	}
+	for(j = 1; i < COMMANDS && j <= commandUsage[i].operands; j += 1) {
+		if(args[j] == NULL) {
+			printf("usage: %s\n", commandUsage[i].usage);
+			return -1;
+		}
+	}
+
+	//mkfs osfile1 512 10MB [osfile1.img] [-compress] [-dedup] [-inode-ratio bytes] [-mounts n] [-file-size bytes]
+	if(strcmp(args[0], "mkfs") == 0) {
+		int blockSize = atoi(args[2]);
+		if(blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+			printf("Block size must be a power of two between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+			return -1;
+		}
+		char imagePath[PATH_SIZE];
+		struct FormatOptions options = {0, 0, 0, 0, 0};
+		snprintf(imagePath, PATH_SIZE, "%s.img", args[1]);
+		for(j = 4; args[j] != NULL; j += 1) {
+			if(strcmp(args[j], "-compress") == 0)
+				options.compress = 1;
+			else if(strcmp(args[j], "-dedup") == 0)
+				options.dedup = 1;
+			else if(strcmp(args[j], "-inode-ratio") == 0 || strcmp(args[j], "-mounts") == 0 || strcmp(args[j], "-file-size") == 0) {
+				long long value = args[j + 1] == NULL ? 0 : atoll(args[j + 1]);
+				if(value <= 0 || value > INT_MAX) {
+					printf("%s needs a positive number\n", args[j]);
+					return -1;
+				}
+				if(strcmp(args[j], "-inode-ratio") == 0)
+					options.bytesPerInode = value;
+				else if(strcmp(args[j], "-mounts") == 0)
+					options.maxMounts = (int)value;
+				else
+					options.fileSize = value;
+				j += 1;
+			}
+			else
+				snprintf(imagePath, PATH_SIZE, "%s", args[j]);
+		}
+		struct Disk* d1 = (struct Disk*)malloc(sizeof(struct Disk));
+		if((j = createDiskImage(d1, imagePath, atoi(args[3]), blockSize)) < 0) {
+			if(j == -2)
+				printf("Disk size must be between 1 MB and %lld MB for this block size\n", (long long)INT_MAX * blockSize >> 20);
+			else
+				printf("Cannot create image %s\n", imagePath);
+			free(d1);
+			return -1;
+		}
+		createFileSystemWith(d1, &options);
+		if(mountFileSystem(root, d1, args[1]) < 0) {
+			printf("Cannot mount %s\n", args[1]);
+			closeDisk(d1);
+			free(d1);
+			return -1;
+		}
+	}
+	//attach osfile1 osfile1.img
+	else if(strcmp(args[0], "attach") == 0) {
+		struct Disk* d1 = (struct Disk*)malloc(sizeof(struct Disk));
+		if(attachDiskImage(d1, args[2]) < 0) {
+			printf("Cannot open image %s\n", args[2]);
+			free(d1);
+			return -1;
+		}
+		if((j = loadFileSystem(d1)) < 0 || mountFileSystem(root, d1, args[1]) < 0) {
+			if(j == -4)
+				printf("Cannot replay the journal of %s\n", args[2]);
+			else
+				printf("Cannot attach %s\n", args[2]);
+			closeDisk(d1);
+			free(d1);
+			return -1;
+		}
+	}
+	//compress C:[\filename] [on|off]
+	else if(strcmp(args[0], "compress") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		struct SuperBlock sb;
+		int on = args[2] != NULL && strcmp(args[2], "on") == 0;
+		if(args[2] != NULL && on == 0 && strcmp(args[2], "off") != 0) {
+			printf("Use on or off\n");
+			return -1;
+		}
+		if(p1 -> inumber == -1) {
+			if(args[2] != NULL)
+				setDiskCompression(p1 -> location, on);
+			getSuperBlock(p1 -> location, &sb);
+			printf("New files are %scompressed\n", sb.compress ? "" : "not ");
+			return 0;
+		}
+		if(args[2] != NULL && (j = compressFile(p1 -> location, p1 -> inumber, on)) < 0) {
+			if(j == -3)
+				printf("Is a directory\n");
+			else if(j == -2)
+				printf("Space not available\n");
+			else
+				printf("Cannot rewrite %s\n", args[1]);
+			return -1;
+		}
+		getSuperBlock(p1 -> location, &sb);
+		struct Inode i1;
+		getInode(p1 -> location, sb.inode, p1 -> inumber, &i1);
+		if(i1.compressed)
+			printf("%lld bytes in %lld bytes of blocks\n", i1.sizeofFile, i1.storedSize);
+		else
+			printf("Not compressed\n");
+	}
+	//sync [osfile1]
+	else if(strcmp(args[0], "sync") == 0) {
+		if(args[1] == NULL) {
+			if(syncAll(root) < 0) {
+				printf("Cannot write the journal of every disk\n");
+				return -1;
+			}
+			return 0;
+		}
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(syncDisk(p1 -> location) < 0) {
+			printf("Cannot write the journal of %s\n", args[1]);
+			return -1;
+		}
+	}
+	//cache osfile1 [frames]
+	else if(strcmp(args[0], "cache") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(p1 -> location -> cache == NULL) {
+			printf("Disk is not cached\n");
+			return -1;
+		}
+		if(args[2] != NULL && atoi(args[2]) > 0) {
+			int limit = p1 -> location -> cache -> limit;
+			if(syncDisk(p1 -> location) < 0) {
+				printf("Cannot write the journal of %s\n", args[1]);
+				return -1;
+			}
+			destroyCache(p1 -> location -> cache);
+			p1 -> location -> cache = createCache(p1 -> location -> fd, p1 -> location -> blockSize, limit, atoi(args[2]));
+			p1 -> location -> cache -> journaled = p1 -> location -> journal != NULL;
+		}
+		printCacheStats(p1 -> location -> cache);
+	}
+	//detach osfile1
+	else if(strcmp(args[0], "detach") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(p1 -> inumber != -1 || unmountFileSystem(root, p1 -> location) < 0) {
+			printf("Not a mounted disk\n");
+			return -1;
+		}
+		if(cwd -> location == p1 -> location) {
+			cwd -> location = root;
+			cwd -> inumber = -1;
+		}
+		j = closeDisk(p1 -> location);
+		free(p1 -> location);
+		if(j < 0) {
+			printf("Cannot write the journal of %s\n", args[1]);
+			return -1;
+		}
+	}
+	//use osfile1 as C:
+	else if(strcmp(args[0], "use") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(renameFileSystem(root, p1 -> location, args[3]) < 0) {
+			printf("Cannot rename %s\n", args[1]);
+			return -1;
+		}
+	}
+	//cp osfile3 C:\tesfile1 
+	//import osfile3 C:\tesfile1
+	//A source that is not in the file system is read from the host.
+	else if(strcmp(args[0], "cp") == 0 || (strcmp(args[0], "import") == 0 && strcmp(args[1], "-r") != 0)) {
+		i = strcmp(args[0], "cp") == 0 ? resolvePath(args[1], p1, root, cwd) : -1;
+		if(i < 0 && access(args[1], R_OK) != 0) {
+			printf("Path is invalid\n");
+			return -1;
+		}
+		if(i > 0 && isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		partition(args[2], p3, root, cwd);
+		if(p3 -> location == NULL) 
+			return -1;
+		createFile(p3 -> location, p3 -> parent, p3 -> fileName);
+		pathResolution(args[2], p2, root, cwd);
+		if(p2 -> location == NULL && p2 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p2 -> location, p2 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		if(i < 0)
+			j = importFile(p2 -> location, p2 -> inumber, args[1]);
+		else
+			j = copyFile(p1 -> location, p1 -> inumber, p2 -> location, p2 -> inumber);
+		if(j == -5)
+			printf("Damaged chunk in %s\n", args[1]);
+		else if(j == -4)
+			printf("Cannot read %s\n", args[1]);
+		else if(j == -2)
+			printf("Space not available\n");
+		else if(j == -1)
+			printf("Size exceeded\n");
+		return j < 0 ? -1 : 0;
+	}
+	//import -r hostdir C:\dir [threads]
+	else if(strcmp(args[0], "import") == 0) {
+		partition(args[3], p3, root, cwd);
+		if(p3 -> location == NULL) 
+			return -1;
+		makeDirectory(p3 -> location, p3 -> parent, p3 -> fileName);
+		pathResolution(args[3], p2, root, cwd);
+		if(p2 -> location == NULL && p2 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p2 -> location, p2 -> inumber) == 0) {
+			printf("Not a directory\n");
+			return -1;
+		}
+		if(importTree(p2 -> location, p2 -> inumber, args[2], args[4] == NULL ? IMPORT_THREADS : atoi(args[4])) > 0)
+			return -1;
+	}
+	//export C:\tesfile1 osfile3
+	else if(strcmp(args[0], "export") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		if((j = exportFile(p1 -> location, p1 -> inumber, args[2])) < 0) {
+			if(j == -5)
+				printf("Damaged chunk in %s\n", args[1]);
+			else
+				printf("Cannot write %s\n", args[2]);
+			return -1;
+		}
+	}
+	//ls [C:\dir]
+	else if(strcmp(args[0], "ls") == 0) {
+		pathResolution(args[1] == NULL ? "." : args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber) == 0) {
+			printf("Not a directory\n");
+			return -1;
+		}
+		ls(p1 -> location, p1 -> inumber);
+	}
+	//rm C:\testfile1
+	else if(strcmp(args[0], "rm") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(p1 -> inumber == -1 || removeFile(p1 -> location, p1 -> inumber) < 0) {
+			printf("Is a directory\n");
+			return -1;
+		}
+	}
+	//mkdir C:\dir
+	else if(strcmp(args[0], "mkdir") == 0) {
+		partition(args[1], p3, root, cwd);
+		if(p3 -> location == NULL) 
+			return -1;
+		j = makeDirectory(p3 -> location, p3 -> parent, p3 -> fileName);
+		if(j == -3)
+			printf("Invalid name\n");
+		else if(j == -2)
+			printf("Already exists\n");
+		else if(j == -1)
+			printf("Space not available\n");
+		return j < 0 ? -1 : 0;
+	}
+	//rmdir C:\dir
+	else if(strcmp(args[0], "rmdir") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(p1 -> location == cwd -> location && p1 -> inumber == cwd -> inumber) {
+			printf("Cannot remove the current directory\n");
+			return -1;
+		}
+		j = removeDirectory(p1 -> location, p1 -> inumber);
+		if(j == -2)
+			printf("Not a directory\n");
+		else if(j == -1)
+			printf("Directory not empty\n");
+		return j < 0 ? -1 : 0;
+	}
+	//cd C:\dir
+	else if(strcmp(args[0], "cd") == 0) {
+		pathResolution(args[1] == NULL ? "\\" : args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber) == 0) {
+			printf("Not a directory\n");
+			return -1;
+		}
+		*cwd = *p1;
+	}
+	//pwd
+	else if(strcmp(args[0], "pwd") == 0) {
+		printPath(root, cwd);
+		printf("\n");
+	}
+	//mv D:\testfile2 D:\testfile2a
+	//Within one disk only the name moves; across disks the data is copied.
+	else if(strcmp(args[0], "mv") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(p1 -> inumber == -1) {
+			printf("Cannot move a disk\n");
+			return -1;
+		}
+		if(resolvePath(args[2], p2, root, cwd) > 0 && isDirectoryInode(p2 -> location, p2 -> inumber)) {
+			p3 -> location = p2 -> location;
+			p3 -> parent = p2 -> inumber;
+			j = 1; //keep the name
+		}
+		else {
+			partition(args[2], p3, root, cwd);
+			j = 0;
+		}
+		if(p3 -> location == NULL) 
+			return -1;
+		if(p3 -> location == p1 -> location) {
+			j = renameFile(p1 -> location, p1 -> inumber, p3 -> parent, j == 1 ? NULL : p3 -> fileName);
+			if(j == -3)
+				printf("Invalid name\n");
+			else if(j == -2)
+				printf("Already exists\n");
+			else if(j == -1)
+				printf("Cannot move a directory into itself\n");
+			return j < 0 ? -1 : 0;
+		}
+		if(isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		if(j == 1) {
+			char* base = strrchr(args[1], '\\');
+			snprintf((char*)p3 -> fileName, PATH_SIZE, "%s", base == NULL ? args[1] : base + 1);
+		}
+		int created = createFile(p3 -> location, p3 -> parent, p3 -> fileName) > 0;
+		p2 -> location = p3 -> location;
+		p2 -> inumber = dentryLookup(p3 -> location, p3 -> parent, p3 -> fileName, &i);
+		if(p2 -> inumber == -1) {
+			printf("Invalid name\n");
+			return -1;
+		}
+		if(i) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		j = copyFile(p1 -> location, p1 -> inumber, p2 -> location, p2 -> inumber);
+		if(j == -5)
+			printf("Damaged chunk in %s\n", args[1]);
+		else if(j == -2)
+			printf("Space not available\n");
+		else if(j == -1)
+			printf("Size exceeded\n");
+		if(j < 0) {
+			if(created)
+				removeFile(p2 -> location, p2 -> inumber); //Leave both disks as they were
+			return -1;
+		}
+		removeFile(p1 -> location, p1 -> inumber);
+	}
+	//create C:\dir filename
+	else if(strcmp(args[0], "create") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber) == 0) {
+			printf("Not a directory\n");
+			return -1;
+		}
+		j = createFile(p1 -> location, p1 -> inumber, (unsigned char*)(args[2] == NULL ? "" : args[2]));
+		if(j == -3)
+			printf("Invalid name\n");
+		else if(j == -2)
+			printf("Already exists\n");
+		else if(j == -1)
+			printf("Space not available\n");
+		return j < 0 ? -1 : 0;
+	}
+	//display C:\filename
+	else if(strcmp(args[0], "display") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		fflush(stdout);
+		j = streamFile(p1 -> location, p1 -> inumber, STDOUT_FILENO);
+		printf("\n");
+		if(j == -5)
+			printf("Damaged chunk in %s\n", args[1]);
+		if(j < 0)
+			return -1;
+	}
+	//write C:\filename
+	else if(strcmp(args[0], "write") == 0) {
+		partition(args[1], p3, root, cwd);
+		if(p3 -> location == NULL) 
+			return -1;
+		createFile(p3 -> location, p3 -> parent, p3 -> fileName);
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		line = readLine(input);
+		if(line == NULL)
+			return -1; //No data line
+		j = writeFile(p1 -> location, p1 -> inumber, (unsigned char*)line, strlen(line));
+		if(j == -1)
+			printf("Size exceeded\n");
+		else if(j == -2)
+			printf("Space not available\n");
+		return j < 0 ? -1 : 0;
+	}
+	//pread C:\filename offset length
+	else if(strcmp(args[0], "pread") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		j = args[2] != NULL && args[3] != NULL ? atoi(args[3]) : 0;
+		size_t mark = arenaMark();
+		if((buffer = (unsigned char*)arenaTryAlloc(j > 0 ? j : 1)) == NULL) {
+			printf("Size exceeded\n");
+			return -1;
+		}
+		j = readFileAt(p1 -> location, p1 -> inumber, j > 0 ? atoll(args[2]) : 0, buffer, j);
+		if(j > 0)
+			fwrite(buffer, 1, j, stdout);
+		printf("\n");
+		arenaReset(mark);
+		if(j == -4)
+			printf("Damaged chunk in %s\n", args[1]);
+		if(j < 0)
+			return -1;
+	}
+	//pwrite C:\filename offset
+	//append C:\filename
+	else if(strcmp(args[0], "pwrite") == 0 || strcmp(args[0], "append") == 0) {
+		partition(args[1], p3, root, cwd);
+		if(p3 -> location == NULL) 
+			return -1;
+		createFile(p3 -> location, p3 -> parent, p3 -> fileName);
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		if(isDirectoryInode(p1 -> location, p1 -> inumber)) {
+			printf("Is a directory\n");
+			return -1;
+		}
+		//The data line is read into the buffer args point into, so take the offset first.
+		long long offset = strcmp(args[0], "append") == 0 ? -1 : args[2] == NULL ? 0 : atoll(args[2]);
+		line = readLine(input);
+		if(line == NULL)
+			return -1; //No data line
+		if(offset == -1)
+			j = appendFile(p1 -> location, p1 -> inumber, (unsigned char*)line, strlen(line));
+		else
+			j = writeFileAt(p1 -> location, p1 -> inumber, offset, (unsigned char*)line, strlen(line));
+		if(j == -1)
+			printf("Size exceeded\n");
+		else if(j == -2)
+			printf("Space not available\n");
+		return j < 0 ? -1 : 0;
+	}
+	//truncate C:\filename size
+	else if(strcmp(args[0], "truncate") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1) 
+			return -1;
+		j = truncateFile(p1 -> location, p1 -> inumber, args[2] == NULL ? 0 : atoll(args[2]));
+		if(j == -3)
+			printf("Is a directory\n");
+		else if(j == -1)
+			printf("Size exceeded\n");
+		return j < 0 ? -1 : 0;
+	}
+	//stats [reset|json]
+	else if(strcmp(args[0], "stats") == 0) {
+		if(args[1] != NULL && strcmp(args[1], "reset") == 0)
+			resetStats(root);
+		else
+			printStats(root, args[1] != NULL && strcmp(args[1], "json") == 0);
+	}
+	//df
+	else if(strcmp(args[0], "df") == 0)
+		printUsage(root);
+	//fsck C: [repair] [threads]
+	else if(strcmp(args[0], "fsck") == 0) {
+		pathResolution(args[1], p1, root, cwd);
+		if(p1 -> location == NULL && p1 -> inumber == -1)
+			return -1;
+		if(p1 -> inumber != -1) {
+			printf("Not a drive\n");
+			return -1;
+		}
+		int repair = args[2] != NULL && strcmp(args[2], "repair") == 0;
+		int threads = args[2 + repair] == NULL ? sysconf(_SC_NPROCESSORS_ONLN) : atoi(args[2 + repair]);
+		struct FsckReport report;
+		uint64_t started = nowNanos();
+		long long problems = checkFileSystem(p1 -> location, repair, threads, &report);
+		printFsckReport(&report, (nowNanos() - started) / 1e9);
+		if(problems == 0)
+			printf("Clean\n");
+		else if(repair)
+			printf("%lld problems, %lld repaired\n", problems, problems - fsckUnfixable(&report));
+		else
+			printf("%lld problems, run fsck %s repair to fix\n", problems, args[1]);
+		if(problems > 0 && (repair == 0 || fsckUnfixable(&report) > 0))
+			return -1;
+	}
+	//exit
+	else if(strcmp(args[0], "exit") == 0)
+		return 1;
+	else {
+		printf("Unknown command %s\n", args[0]);
+		return -1;
+	}
 	return 0;
 }
+
+double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+//--------------------------------------------//
+
+#ifndef MYFS_NO_MAIN
+//myfs [-f script]
+//Commands come from script, or from stdin. Unless stdin is a terminal no
+//prompt is shown, failures are reported with their line number and a
+//summary is printed at the end.
+int main(int argc, char** argv) {
+	int fd = STDIN_FILENO;
+	if(argc == 3 && strcmp(argv[1], "-f") == 0) {
+		fd = open(argv[2], O_RDONLY);
+		if(fd < 0) {
+			fprintf(stderr, "Cannot open %s\n", argv[2]);
+			return 1;
+		}
+	}
+	else if(argc != 1) {
+		fprintf(stderr, "usage: %s [-f script]\n", argv[0]);
+		return 1;
+	}
+	int batch = fd != STDIN_FILENO || isatty(STDIN_FILENO) == 0;
+
+	struct Disk* root = (struct Disk*)malloc(sizeof(struct Disk));
+	if(createDisk(root, 100, 2048) < 0) {
+		fprintf(stderr, "Cannot map the root disk\n");
+		return 1;
+	}
+	createFileSystem(root);
+	struct Path* cwd = (struct Path*)malloc(sizeof(struct Path));
+	cwd -> location = root;
+	cwd -> inumber = -1;
+	struct LineReader input;
+	initLineReader(&input, fd);
+
+	char* line;
+	char* args[MAX_ARGS + 1];
+	char name[STRING_SIZE];
+	long long commands = 0, failed = 0, lineNumber;
+	int i, result = 0;
+	double start = now();
+
+	while(result != 1) {
+		if(batch == 0) {
+			printf("myfs> ");
+			fflush(stdout);
+		}
+		if((line = readLine(&input)) == NULL)
+			break;
+		lineNumber = input.lines;
+		i = splitLine(line, args, MAX_ARGS);
+		if(args[0] == NULL || args[0][0] == '#')
+			continue;
+		snprintf(name, STRING_SIZE, "%s", args[0]);
+		if(i < 0) {
+			printf("Too many arguments\n");
+			result = -1;
+		}
+		else
+			result = runCommand(args, root, cwd, &input);
+		commands += 1;
+		if(result < 0) {
+			failed += 1;
+			if(batch)
+				fprintf(stderr, "line %lld: %s failed\n", lineNumber, name);
+		}
+	}
+	if(batch) {
+		double elapsed = now() - start;
+		fflush(stdout);
+		fprintf(stderr, "%lld commands, %lld failed, %.3f s, %.0f commands/s\n", commands, failed, elapsed, elapsed > 0 ? commands / elapsed : 0);
+	}
+	unmountAll(root);
+	closeDisk(root);
+	free(root);
+	free(cwd);
+	freeLineReader(&input);
+	if(fd != STDIN_FILENO)
+		close(fd);
+	return batch && failed > 0 ? 2 : 0;
+}
+#endif